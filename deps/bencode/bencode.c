@@ -2,10 +2,16 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
-#include <errno.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <limits.h>
 #include "bencode.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BEN_X86_SIMD
+#include <immintrin.h>
+#endif
+
 #define MAX_ALLOC (((size_t) -1) / sizeof(struct bencode *) / 2)
 
 struct decode {
@@ -14,6 +20,11 @@ struct decode {
 	size_t off;
 	int error;
 	int level;
+	struct ben_arena *arena;
+	int view; /* strings point into data */
+	/* for ben_parse() */
+	const struct ben_parser *parser;
+	void *arg;
 };
 
 /*
@@ -30,13 +41,77 @@ struct bencode_keyvalue {
 
 static struct bencode *decode(struct decode *ctx);
 
-static size_t find(const char *data, size_t len, size_t off, char c)
+/*
+ * Integers and string lengths end at the first byte that is not a digit,
+ * which must be their delimiter. digits() returns the number of digits
+ * at the start of 's', looking at no more than 'len' bytes. It is chosen
+ * at runtime from the versions below: AVX2 and SSE2 compare a block of
+ * bytes at once, and the plain C one is for other processors.
+ */
+#define DIGITS_MAX 32 /* digits() need not look further than this */
+
+static size_t digits_scalar(const char *s, size_t len)
+{
+	size_t n = 0;
+	while (n < len && (unsigned char) (s[n] - '0') <= 9)
+		n++;
+	return n;
+}
+
+#ifdef BEN_X86_SIMD
+__attribute__((target("sse2")))
+static size_t digits_sse2(const char *s, size_t len)
 {
-	for (; off < len; off++) {
-		if (data[off] == c)
-			return off;
+	const __m128i zero = _mm_set1_epi8('0');
+	const __m128i nine = _mm_set1_epi8(9);
+	size_t n = 0;
+	__m128i x;
+	unsigned mask;
+
+	for (; n + 16 <= len; n += 16) {
+		/* bytes from '0' to '9' are 0 to 9 after the subtraction */
+		x = _mm_sub_epi8(_mm_loadu_si128((const __m128i *) (s + n)), zero);
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(x, nine), x));
+		if (mask != 0xffff)
+			return n + __builtin_ctz(~mask);
 	}
-	return -1;
+	return n + digits_scalar(s + n, len - n);
+}
+
+__attribute__((target("avx2")))
+static size_t digits_avx2(const char *s, size_t len)
+{
+	const __m256i zero = _mm256_set1_epi8('0');
+	const __m256i nine = _mm256_set1_epi8(9);
+	__m256i x;
+	unsigned mask;
+
+	if (len < 32)
+		return digits_sse2(s, len);
+	x = _mm256_sub_epi8(_mm256_loadu_si256((const __m256i *) s), zero);
+	mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(x, nine),
+						      x));
+	if (mask != 0xffffffff)
+		return __builtin_ctz(~mask);
+	return 32 + digits_sse2(s + 32, len - 32);
+}
+#endif
+
+static size_t digits_init(const char *s, size_t len);
+
+static size_t (*digits)(const char *s, size_t len) = digits_init;
+
+static size_t digits_init(const char *s, size_t len)
+{
+	digits = digits_scalar;
+#ifdef BEN_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		digits = digits_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		digits = digits_sse2;
+#endif
+	return digits(s, len);
 }
 
 static size_t type_size(int type)
@@ -58,15 +133,108 @@ static size_t type_size(int type)
 	}
 }
 
-static void *alloc(int type)
+/* Arena allocations are aligned for any node */
+#define ARENA_ALIGN sizeof(union { long long ll; double d; void *p; })
+/* Size of the first block an arena takes from malloc(). Each one doubles. */
+#define ARENA_BLOCK 4096
+
+struct ben_arena_block {
+	struct ben_arena_block *next;
+};
+
+void ben_arena_init(struct ben_arena *arena, void *buf, size_t size)
+{
+	arena->buf = buf;
+	arena->size = buf != NULL ? size : 0;
+	arena->p = arena->buf;
+	arena->left = arena->size;
+	arena->next = ARENA_BLOCK;
+	arena->blocks = NULL;
+}
+
+void *ben_arena_alloc(struct ben_arena *arena, size_t size)
 {
-	struct bencode *b = calloc(1, type_size(type));
+	struct ben_arena_block *block;
+	size_t blocksize;
+	size_t pad;
+	void *p;
+
+	pad = -(uintptr_t) arena->p & (ARENA_ALIGN - 1);
+	if (arena->p == NULL || pad + size > arena->left) {
+		if (size > MAX_ALLOC)
+			return NULL;
+		blocksize = arena->next;
+		if (blocksize < size + ARENA_ALIGN)
+			blocksize = size + ARENA_ALIGN;
+		block = malloc(sizeof(*block) + blocksize);
+		if (block == NULL)
+			return NULL;
+		block->next = arena->blocks;
+		arena->blocks = block;
+		arena->p = (char *) (block + 1);
+		arena->left = blocksize;
+		if (arena->next < MAX_ALLOC)
+			arena->next *= 2;
+		pad = -(uintptr_t) arena->p & (ARENA_ALIGN - 1);
+	}
+	p = arena->p + pad;
+	arena->p += pad + size;
+	arena->left -= pad + size;
+	return p;
+}
+
+void ben_arena_release(struct ben_arena *arena)
+{
+	struct ben_arena_block *block;
+	while (arena->blocks != NULL) {
+		block = arena->blocks;
+		arena->blocks = block->next;
+		free(block);
+	}
+	ben_arena_init(arena, arena->buf, arena->size);
+}
+
+/* Allocate a zeroed node from 'arena', or with malloc() if it is NULL */
+static void *alloc(struct ben_arena *arena, int type)
+{
+	struct bencode *b;
+	if (arena == NULL) {
+		b = calloc(1, type_size(type));
+	} else {
+		b = ben_arena_alloc(arena, type_size(type));
+		if (b != NULL)
+			memset(b, 0, type_size(type));
+	}
 	if (b == NULL)
 		return NULL;
 	b->type = type;
+	if (type == BENCODE_DICT)
+		((struct bencode_dict *) b)->arena = arena;
+	else if (type == BENCODE_LIST)
+		((struct bencode_list *) b)->arena = arena;
 	return b;
 }
 
+/* Grow an array of a dict or list in 'arena', or with realloc() */
+static void *resize_array(struct ben_arena *arena, void *old, size_t oldsize,
+			  size_t newsize)
+{
+	void *p;
+	if (arena == NULL)
+		return realloc(old, newsize);
+	p = ben_arena_alloc(arena, newsize);
+	if (p != NULL && oldsize > 0)
+		memcpy(p, old, oldsize);
+	return p;
+}
+
+/* Free a node, unless it is in an arena and goes with it */
+static void drop(struct ben_arena *arena, struct bencode *b)
+{
+	if (arena == NULL)
+		ben_free(b);
+}
+
 static int insufficient(struct decode *ctx)
 {
 	ctx->error = BEN_INSUFFICIENT;
@@ -110,7 +278,7 @@ static struct bencode *decode_bool(struct decode *ctx)
 		return invalid_ptr(ctx);
 
 	value = (c == '1');
-	b = alloc(BENCODE_BOOL);
+	b = alloc(ctx->arena, BENCODE_BOOL);
 	if (b == NULL)
 		return oom_ptr(ctx);
 
@@ -123,26 +291,27 @@ static int resize_dict(struct bencode_dict *d)
 {
 	struct bencode **newkeys;
 	struct bencode **newvalues;
+	size_t newalloc;
+	size_t oldsize;
 	size_t newsize;
 
 	if (d->alloc >= MAX_ALLOC)
 		return -1;
 
-	if (d->alloc == 0)
-		d->alloc = 4;
-	else
-		d->alloc *= 2;
-	newsize = sizeof(d->values[0]) * d->alloc;
-
-	newkeys = realloc(d->keys, newsize);
-	newvalues = realloc(d->values, newsize);
-	if (newkeys == NULL || newvalues == NULL) {
-		free(newkeys);
-		free(newvalues);
+	newalloc = d->alloc == 0 ? 4 : d->alloc * 2;
+	oldsize = sizeof(d->values[0]) * d->n;
+	newsize = sizeof(d->values[0]) * newalloc;
+
+	/* realloc() may move the old arrays, so each is kept as it goes */
+	newkeys = resize_array(d->arena, d->keys, oldsize, newsize);
+	if (newkeys == NULL)
 		return -1;
-	}
 	d->keys = newkeys;
+	newvalues = resize_array(d->arena, d->values, oldsize, newsize);
+	if (newvalues == NULL)
+		return -1;
 	d->values = newvalues;
+	d->alloc = newalloc;
 	return 0;
 }
 
@@ -190,7 +359,7 @@ static struct bencode *decode_dict(struct decode *ctx)
 	struct bencode *value;
 	struct bencode_dict *d;
 
-	d = alloc(BENCODE_DICT);
+	d = alloc(ctx->arena, BENCODE_DICT);
 	if (d == NULL) {
 		fprintf(stderr, "bencode: Not enough memory for dict\n");
 		return oom_ptr(ctx);
@@ -208,14 +377,14 @@ static struct bencode *decode_dict(struct decode *ctx)
 		if (key == NULL)
 			goto error;
 		if (key->type != BENCODE_INT && key->type != BENCODE_STR) {
-			ben_free(key);
+			drop(ctx->arena, key);
 			key = NULL;
 			ctx->error = BEN_INVALID;
 			fprintf(stderr, "bencode: Invalid dict key type\n");
 			goto error;
 		}
 		if (d->n > 0 && ben_cmp(d->keys[d->n - 1], key) >= 0) {
-			ben_free(key);
+			drop(ctx->arena, key);
 			key = NULL;
 			ctx->error = BEN_INVALID;
 			goto error;
@@ -223,7 +392,7 @@ static struct bencode *decode_dict(struct decode *ctx)
 
 		value = decode(ctx);
 		if (value == NULL) {
-			ben_free(key);
+			drop(ctx->arena, key);
 			key = NULL;
 			goto error;
 		}
@@ -241,36 +410,32 @@ static struct bencode *decode_dict(struct decode *ctx)
 	return (struct bencode *) d;
 
 error:
-	ben_free((struct bencode *) d);
+	drop(ctx->arena, (struct bencode *) d);
 	return NULL;
 }
 
 /* off is the position of first number in */
 static int read_long_long(long long *ll, struct decode *ctx, int c)
 {
-	char buf[LONGLONGSIZE]; /* fits all 64 bit integers */
-	size_t pos;
-	char *endptr;
-	size_t slen;
-
-	pos = find(ctx->data, ctx->len, ctx->off, c);
-	if (pos == -1)
-		return insufficient(ctx);
-
-	slen = pos - ctx->off;
-	if (slen == 0 || slen >= sizeof buf)
-		return invalid(ctx);
-
-	assert(slen < sizeof buf);
-	memcpy(buf, ctx->data + ctx->off, slen);
-	buf[slen] = 0;
+	const char *s = ctx->data + ctx->off;
+	size_t left = ctx->len - ctx->off;
+	unsigned long long value = 0;
+	unsigned long long limit = LLONG_MAX;
+	size_t sign = 0;
+	size_t n;
+	size_t i;
 
-	if (buf[0] != '-' && !isdigit(buf[0]))
+	if (left > 0 && s[0] == '-') {
+		sign = 1;
+		limit = (unsigned long long) LLONG_MAX + 1;
+	}
+	n = digits(s + sign, left - sign < DIGITS_MAX ?
+		   left - sign : DIGITS_MAX);
+	if (n >= LONGLONGSIZE)
 		return invalid(ctx);
-
-	errno = 0;
-	*ll = strtoll(buf, &endptr, 10);
-	if (errno == ERANGE || *endptr != 0)
+	if (sign + n == left)
+		return insufficient(ctx);
+	if (n == 0 || s[sign + n] != c)
 		return invalid(ctx);
 
 	/*
@@ -278,12 +443,21 @@ static int read_long_long(long long *ll, struct decode *ctx, int c)
 	 * Zero may not begin with a (minus) sign.
 	 * Non-zero integers may not have leading zeros in the encoding.
 	 */
-	if (buf[0] == '-' && buf[1] == '0')
-		return invalid(ctx);
-	if (buf[0] == '0' && pos != (ctx->off + 1))
+	if (s[sign] == '0' && (sign || n > 1))
 		return invalid(ctx);
 
-	ctx->off = pos + 1;
+	for (i = sign; i < sign + n; i++) {
+		unsigned d = s[i] - '0';
+		if (value > (limit - d) / 10)
+			return invalid(ctx);
+		value = value * 10 + d;
+	}
+	if (sign)
+		*ll = value == limit ? LLONG_MIN : -(long long) value;
+	else
+		*ll = value;
+
+	ctx->off += sign + n + 1;
 	return 0;
 }
 
@@ -294,7 +468,7 @@ static struct bencode *decode_int(struct decode *ctx)
 	ctx->off += 1;
 	if (read_long_long(&ll, ctx, 'e'))
 		return NULL;
-	b = alloc(BENCODE_INT);
+	b = alloc(ctx->arena, BENCODE_INT);
 	if (b == NULL)
 		return oom_ptr(ctx);
 	b->ll = ll;
@@ -304,27 +478,27 @@ static struct bencode *decode_int(struct decode *ctx)
 static int resize_list(struct bencode_list *list)
 {
 	struct bencode **newvalues;
+	size_t newalloc;
 	size_t newsize;
 
 	if (list->alloc >= MAX_ALLOC)
 		return -1;
 
-	if (list->alloc == 0)
-		list->alloc = 4;
-	else
-		list->alloc *= 2;
-	newsize = sizeof(list->values[0]) * list->alloc;
+	newalloc = list->alloc == 0 ? 4 : list->alloc * 2;
+	newsize = sizeof(list->values[0]) * newalloc;
 
-	newvalues = realloc(list->values, newsize);
+	newvalues = resize_array(list->arena, list->values,
+				 sizeof(list->values[0]) * list->n, newsize);
 	if (newvalues == NULL)
 		return -1;
 	list->values = newvalues;
+	list->alloc = newalloc;
 	return 0;
 }
 
 static struct bencode *decode_list(struct decode *ctx)
 {
-	struct bencode_list *l = alloc(BENCODE_LIST);
+	struct bencode_list *l = alloc(ctx->arena, BENCODE_LIST);
 	if (l == NULL)
 		return oom_ptr(ctx);
 
@@ -335,7 +509,7 @@ static struct bencode *decode_list(struct decode *ctx)
 		if (b == NULL)
 			goto error;
 		if (ben_list_append((struct bencode *) l, b)) {
-			ben_free(b);
+			drop(ctx->arena, b);
 			ctx->error = BEN_NO_MEMORY;
 			goto error;
 		}
@@ -350,7 +524,7 @@ static struct bencode *decode_list(struct decode *ctx)
 	return (struct bencode *) l;
 
 error:
-	ben_free((struct bencode *) l);
+	drop(ctx->arena, (struct bencode *) l);
 	return NULL;
 }
 
@@ -382,18 +556,27 @@ static struct bencode *decode_str(struct decode *ctx)
 	if ((ctx->off + datalen) > ctx->len)
 		return insufficient_ptr(ctx);
 
-	/* Allocate string structure and copy data into it */
-	b = ben_blob(ctx->data + ctx->off, datalen);
+	if (ctx->view) {
+		/* The string stays where it is in the data */
+		struct bencode_str *str = alloc(ctx->arena, BENCODE_STR);
+		if (str == NULL)
+			return oom_ptr(ctx);
+		str->view = 1;
+		str->len = datalen;
+		str->s = (char *) ctx->data + ctx->off;
+		b = (struct bencode *) str;
+	} else {
+		/* Allocate string structure and copy data into it */
+		b = ben_arena_blob(ctx->arena, ctx->data + ctx->off, datalen);
+		if (b == NULL)
+			return oom_ptr(ctx);
+	}
 	ctx->off += datalen;
 	return b;
 }
 
-static struct bencode *decode(struct decode *ctx)
+static struct bencode *decode_item(struct decode *ctx)
 {
-	ctx->level++;
-	if (ctx->level > 256)
-		return invalid_ptr(ctx);
-
 	if (ctx->off == ctx->len)
 		return insufficient_ptr(ctx);
 
@@ -423,20 +606,282 @@ static struct bencode *decode(struct decode *ctx)
 	}
 }
 
+static struct bencode *decode(struct decode *ctx)
+{
+	struct bencode *b;
+	/* level is the depth of nesting */
+	if (ctx->level >= 256)
+		return invalid_ptr(ctx);
+	ctx->level++;
+	b = decode_item(ctx);
+	ctx->level--;
+	return b;
+}
+
+static int stopped(struct decode *ctx)
+{
+	ctx->error = BEN_STOPPED;
+	return -1;
+}
+
+#define CALLBACK(ctx, fn, ...) \
+	((ctx)->parser->fn != NULL && (ctx)->parser->fn((ctx)->arg, ##__VA_ARGS__))
+
+static int parse(struct decode *ctx);
+
+/* a string at ctx->off, as a pointer into the data */
+static int parse_str_view(struct decode *ctx, const char **s, size_t *len)
+{
+	*len = read_size_t(ctx, ':');
+	if (*len == -1)
+		return -1;
+	if ((ctx->off + *len) > ctx->len)
+		return insufficient(ctx);
+	*s = ctx->data + ctx->off;
+	ctx->off += *len;
+	return 0;
+}
+
+static int parse_dict(struct decode *ctx)
+{
+	/* the previous key, to check the keys are sorted */
+	const char *prev = NULL;
+	size_t prevlen = 0;
+	long long prevll = 0;
+	int prevtype = 0;
+
+	if (CALLBACK(ctx, dict_begin))
+		return stopped(ctx);
+	ctx->off += 1;
+
+	while (ctx->off < ctx->len && ctx->data[ctx->off] != 'e') {
+		const char *s;
+		size_t len;
+		long long ll;
+		int cmp;
+
+		if (ctx->data[ctx->off] == 'i') {
+			ctx->off += 1;
+			if (read_long_long(&ll, ctx, 'e'))
+				return -1;
+			if (prevtype == BENCODE_STR ||
+			    (prevtype == BENCODE_INT && prevll >= ll))
+				return invalid(ctx);
+			prevtype = BENCODE_INT;
+			prevll = ll;
+			if (CALLBACK(ctx, integer, ll))
+				return stopped(ctx);
+		} else if (isdigit((unsigned char) ctx->data[ctx->off])) {
+			if (parse_str_view(ctx, &s, &len))
+				return -1;
+			if (prevtype == BENCODE_STR) {
+				cmp = memcmp(prev, s, prevlen < len ? prevlen : len);
+				if (cmp > 0 || (cmp == 0 && prevlen >= len))
+					return invalid(ctx);
+			}
+			prevtype = BENCODE_STR;
+			prev = s;
+			prevlen = len;
+			if (CALLBACK(ctx, key, s, len))
+				return stopped(ctx);
+		} else {
+			return invalid(ctx);
+		}
+
+		if (parse(ctx))
+			return -1;
+	}
+	if (ctx->off >= ctx->len)
+		return insufficient(ctx);
+
+	ctx->off += 1;
+	if (CALLBACK(ctx, dict_end))
+		return stopped(ctx);
+	return 0;
+}
+
+static int parse_list(struct decode *ctx)
+{
+	if (CALLBACK(ctx, list_begin))
+		return stopped(ctx);
+	ctx->off += 1;
+
+	while (ctx->off < ctx->len && ctx->data[ctx->off] != 'e') {
+		if (parse(ctx))
+			return -1;
+	}
+	if (ctx->off >= ctx->len)
+		return insufficient(ctx);
+
+	ctx->off += 1;
+	if (CALLBACK(ctx, list_end))
+		return stopped(ctx);
+	return 0;
+}
+
+static int parse_item(struct decode *ctx)
+{
+	const char *s;
+	size_t len;
+	long long ll;
+	char c;
+
+	if (ctx->off == ctx->len)
+		return insufficient(ctx);
+
+	switch (ctx->data[ctx->off]) {
+	case '0':
+	case '1':
+	case '2':
+	case '3':
+	case '4':
+	case '5':
+	case '6':
+	case '7':
+	case '8':
+	case '9':
+		if (parse_str_view(ctx, &s, &len))
+			return -1;
+		return CALLBACK(ctx, str, s, len) ? stopped(ctx) : 0;
+	case 'b':
+		if ((ctx->off + 2) > ctx->len)
+			return insufficient(ctx);
+		c = ctx->data[ctx->off + 1];
+		if (c != '0' && c != '1')
+			return invalid(ctx);
+		ctx->off += 2;
+		return CALLBACK(ctx, boolean, c == '1') ? stopped(ctx) : 0;
+	case 'd':
+		return parse_dict(ctx);
+	case 'i':
+		ctx->off += 1;
+		if (read_long_long(&ll, ctx, 'e'))
+			return -1;
+		return CALLBACK(ctx, integer, ll) ? stopped(ctx) : 0;
+	case 'l':
+		return parse_list(ctx);
+	default:
+		return invalid(ctx);
+	}
+}
+
+static int parse(struct decode *ctx)
+{
+	int ret;
+	if (ctx->level >= 256)
+		return invalid(ctx);
+	ctx->level++;
+	ret = parse_item(ctx);
+	ctx->level--;
+	return ret;
+}
+
+int ben_parse(const void *data, size_t len, const struct ben_parser *parser,
+	      void *arg)
+{
+	struct decode ctx = {.data = data, .len = len, .parser = parser,
+			     .arg = arg};
+	if (parse(&ctx))
+		return ctx.error;
+	if (ctx.off != len)
+		return BEN_INVALID;
+	return BEN_OK;
+}
+
 struct bencode *ben_decode(const void *data, size_t len)
 {
-	struct decode ctx = {.data = data, .len = len};
-	struct bencode *b = decode(&ctx);
-	if (b != NULL && ctx.off != len) {
-		ben_free(b);
+	return ben_arena_decode(NULL, data, len);
+}
+
+struct bencode *ben_decode2(const void *data, size_t len, size_t *off, int *error)
+{
+	return ben_arena_decode2(NULL, data, len, off, error);
+}
+
+static struct bencode *decode_all(struct decode *ctx)
+{
+	struct bencode *b = decode(ctx);
+	if (b != NULL && ctx->off != ctx->len) {
+		drop(ctx->arena, b);
 		return NULL;
 	}
 	return b;
 }
 
-struct bencode *ben_decode2(const void *data, size_t len, size_t *off, int *error)
+struct bencode *ben_arena_decode(struct ben_arena *arena, const void *data,
+				 size_t len)
+{
+	struct decode ctx = {.data = data, .len = len, .arena = arena};
+	return decode_all(&ctx);
+}
+
+struct bencode *ben_decode_view(const void *data, size_t len)
+{
+	return ben_arena_decode_view(NULL, data, len);
+}
+
+struct bencode *ben_arena_decode_view(struct ben_arena *arena,
+				      const void *data, size_t len)
+{
+	struct decode ctx = {.data = data, .len = len, .arena = arena,
+			     .view = 1};
+	return decode_all(&ctx);
+}
+
+int ben_materialize(struct bencode *b)
+{
+	return ben_arena_materialize(NULL, b);
+}
+
+int ben_arena_materialize(struct ben_arena *arena, struct bencode *b)
 {
-	struct decode ctx = {.data = data, .len = len, .off = *off};
+	struct bencode_dict *d;
+	struct bencode_list *l;
+	struct bencode_str *str;
+	char *s;
+	size_t pos;
+
+	switch (b->type) {
+	case BENCODE_DICT:
+		d = ben_dict_cast(b);
+		for (pos = 0; pos < d->n; pos++) {
+			if (ben_arena_materialize(arena, d->keys[pos]) ||
+			    ben_arena_materialize(arena, d->values[pos]))
+				return -1;
+		}
+		return 0;
+	case BENCODE_LIST:
+		l = ben_list_cast(b);
+		for (pos = 0; pos < l->n; pos++) {
+			if (ben_arena_materialize(arena, l->values[pos]))
+				return -1;
+		}
+		return 0;
+	case BENCODE_STR:
+		str = ben_str_cast(b);
+		if (!str->view)
+			return 0;
+		if (arena == NULL)
+			s = malloc(str->len + 1);
+		else
+			s = ben_arena_alloc(arena, str->len + 1);
+		if (s == NULL)
+			return -1;
+		memcpy(s, str->s, str->len);
+		s[str->len] = 0;
+		str->s = s;
+		str->view = 0;
+		return 0;
+	default:
+		return 0;
+	}
+}
+
+struct bencode *ben_arena_decode2(struct ben_arena *arena, const void *data,
+				  size_t len, size_t *off, int *error)
+{
+	struct decode ctx = {.data = data, .len = len, .off = *off,
+			     .arena = arena};
 	struct bencode *b = decode(&ctx);
 	*off = ctx.off;
 	if (error != NULL) {
@@ -455,6 +900,9 @@ static void free_dict(struct bencode_dict *d)
 		ben_free(d->values[pos]);
 		d->values[pos] = NULL;
 	}
+	free(d->keys);
+	free(d->values);
+	free(d->index);
 }
 
 static void free_list(struct bencode_list *list)
@@ -464,6 +912,7 @@ static void free_list(struct bencode_list *list)
 		ben_free(list->values[pos]);
 		list->values[pos] = NULL;
 	}
+	free(list->values);
 }
 
 static int putonechar(char *data, size_t size, size_t *pos, char c)
@@ -531,7 +980,6 @@ static int print(char *data, size_t size, size_t *pos, const struct bencode *b)
 	const struct bencode_str *s;
 	size_t i;
 	int len;
-	struct bencode_keyvalue *pairs;
 
 	switch (b->type) {
 	case BENCODE_BOOL:
@@ -547,35 +995,20 @@ static int print(char *data, size_t size, size_t *pos, const struct bencode *b)
 		if (putonechar(data, size, pos, '{'))
 			return -1;
 
+		/* The keys are kept sorted */
 		dict = ben_dict_const_cast(b);
-
-		pairs = malloc(dict->n * sizeof(pairs[0]));
-		if (pairs == NULL) {
-			fprintf(stderr, "bencode: No memory for dict serialization\n");
-			return -1;
-		}
-		for (i = 0; i < dict->n; i++) {
-			pairs[i].key = dict->keys[i];
-			pairs[i].value = dict->values[i];
-		}
-		qsort(pairs, dict->n, sizeof(pairs[0]), ben_cmp_qsort);
-
 		for (i = 0; i < dict->n; i++) {
-			if (print(data, size, pos, pairs[i].key))
-				break;
+			if (print(data, size, pos, dict->keys[i]))
+				return -1;
 			if (putstr(data, size, pos, ": "))
-				break;
-			if (print(data, size, pos, pairs[i].value))
-				break;
+				return -1;
+			if (print(data, size, pos, dict->values[i]))
+				return -1;
 			if (i < (dict->n - 1)) {
 				if (putstr(data, size, pos, ", "))
-					break;
+					return -1;
 			}
 		}
-		free(pairs);
-		pairs = NULL;
-		if (i < dict->n)
-			return -1;
 
 		return putonechar(data, size, pos, '}');
 
@@ -703,7 +1136,6 @@ static int serialize(char *data, size_t size, size_t *pos,
 	const struct bencode_list *list;
 	const struct bencode_str *s;
 	size_t i;
-	struct bencode_keyvalue *pairs;
 
 	switch (b->type) {
 	case BENCODE_BOOL:
@@ -718,29 +1150,14 @@ static int serialize(char *data, size_t size, size_t *pos,
 		if (putonechar(data, size, pos, 'd'))
 			return -1;
 
+		/* The keys are kept sorted */
 		dict = ben_dict_const_cast(b);
-
-		pairs = malloc(dict->n * sizeof(pairs[0]));
-		if (pairs == NULL) {
-			fprintf(stderr, "bencode: No memory for dict serialization\n");
-			return -1;
-		}
-		for (i = 0; i < dict->n; i++) {
-			pairs[i].key = dict->keys[i];
-			pairs[i].value = dict->values[i];
-		}
-		qsort(pairs, dict->n, sizeof(pairs[0]), ben_cmp_qsort);
-
 		for (i = 0; i < dict->n; i++) {
-			if (serialize(data, size, pos, pairs[i].key))
-				break;
-			if (serialize(data, size, pos, pairs[i].value))
-				break;
+			if (serialize(data, size, pos, dict->keys[i]))
+				return -1;
+			if (serialize(data, size, pos, dict->values[i]))
+				return -1;
 		}
-		free(pairs);
-		pairs = NULL;
-		if (i < dict->n)
-			return -1;
 
 		return putonechar(data, size, pos, 'e');
 
@@ -841,6 +1258,22 @@ void *ben_encode(size_t *len, const struct bencode *b)
 	return data;
 }
 
+void *ben_arena_encode(struct ben_arena *arena, size_t *len,
+		       const struct bencode *b)
+{
+	size_t size = get_size(b);
+	void *data = ben_arena_alloc(arena, size);
+	if (data == NULL) {
+		fprintf(stderr, "bencode: No memory to encode\n");
+		return NULL;
+	}
+	*len = 0;
+	if (serialize(data, size, len, b))
+		return NULL;
+	assert(*len == size);
+	return data;
+}
+
 size_t ben_encode2(char *data, size_t maxlen, const struct bencode *b)
 {
 	size_t pos = 0;
@@ -865,7 +1298,8 @@ void ben_free(struct bencode *b)
 		free_list((struct bencode_list *) b);
 		break;
 	case BENCODE_STR:
-		free(((struct bencode_str *) b)->s);
+		if (!((struct bencode_str *) b)->view)
+			free(((struct bencode_str *) b)->s);
 		break;
 	default:
 		fprintf(stderr, "bencode: invalid type: %d\n", b->type);
@@ -878,13 +1312,23 @@ void ben_free(struct bencode *b)
 
 struct bencode *ben_blob(const void *data, size_t len)
 {
-	struct bencode_str *b = alloc(BENCODE_STR);
+	return ben_arena_blob(NULL, data, len);
+}
+
+struct bencode *ben_arena_blob(struct ben_arena *arena, const void *data,
+			       size_t len)
+{
+	struct bencode_str *b = alloc(arena, BENCODE_STR);
 	if (b == NULL)
 		return NULL;
 	/* Allocate one extra byte for zero termination for convenient use */
-	b->s = malloc(len + 1);
+	if (arena == NULL)
+		b->s = malloc(len + 1);
+	else
+		b->s = ben_arena_alloc(arena, len + 1);
 	if (b->s == NULL) {
-		free(b);
+		if (arena == NULL)
+			free(b);
 		return NULL;
 	}
 	memcpy(b->s, data, len);
@@ -895,7 +1339,12 @@ struct bencode *ben_blob(const void *data, size_t len)
 
 struct bencode *ben_bool(int boolean)
 {
-	struct bencode_bool *b = alloc(BENCODE_BOOL);
+	return ben_arena_bool(NULL, boolean);
+}
+
+struct bencode *ben_arena_bool(struct ben_arena *arena, int boolean)
+{
+	struct bencode_bool *b = alloc(arena, BENCODE_BOOL);
 	if (b == NULL)
 		return NULL;
 	b->b = boolean ? 1 : 0;
@@ -904,84 +1353,258 @@ struct bencode *ben_bool(int boolean)
 
 struct bencode *ben_dict(void)
 {
-	return alloc(BENCODE_DICT);
+	return alloc(NULL, BENCODE_DICT);
 }
 
-struct bencode *ben_dict_get(const struct bencode *dict, const struct bencode *key)
+struct bencode *ben_arena_dict(struct ben_arena *arena)
 {
-	const struct bencode_dict *d = ben_dict_const_cast(dict);
+	return alloc(arena, BENCODE_DICT);
+}
+
+/* Hash a dict key for the index. Integer and string keys differ. */
+static size_t hash_key(const struct bencode *key)
+{
+	const struct bencode_str *str;
+	unsigned long long h;
+	size_t i;
+
+	if (key->type == BENCODE_INT) {
+		h = (unsigned long long) ben_int_const_cast(key)->ll;
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		return h;
+	}
+	/* FNV-1a */
+	str = ben_str_const_cast(key);
+	h = 0xcbf29ce484222325ULL;
+	for (i = 0; i < str->len; i++) {
+		h ^= (unsigned char) str->s[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+/* Free the index of 'd', so lookups fall back to binary search */
+static void dict_index_drop(struct bencode_dict *d)
+{
+	if (d->arena == NULL)
+		free(d->index);
+	d->index = NULL;
+	d->index_size = 0;
+}
+
+static void dict_index_put(struct bencode_dict *d, struct bencode *key,
+			   struct bencode *value)
+{
+	size_t mask = d->index_size - 1;
+	size_t i = hash_key(key) & mask;
+	while (d->index[i].key != NULL)
+		i = (i + 1) & mask;
+	d->index[i].key = key;
+	d->index[i].value = value;
+}
+
+/* Find the slot of the key object 'key' itself, which must be indexed */
+static size_t dict_index_slot(const struct bencode_dict *d,
+			      const struct bencode *key)
+{
+	size_t mask = d->index_size - 1;
+	size_t i = hash_key(key) & mask;
+	while (d->index[i].key != key)
+		i = (i + 1) & mask;
+	return i;
+}
+
+/*
+ * Take the key object 'key' out of the index. The slots probed past it
+ * are shifted back into the hole, so lookups need no tombstones.
+ */
+static void dict_index_del(struct bencode_dict *d, const struct bencode *key)
+{
+	size_t mask = d->index_size - 1;
+	size_t i = dict_index_slot(d, key);
+	size_t j;
+	size_t home;
+
+	for (j = (i + 1) & mask; d->index[j].key != NULL; j = (j + 1) & mask) {
+		home = hash_key(d->index[j].key) & mask;
+		/* It may fill the hole unless its home lies after the hole */
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			d->index[i] = d->index[j];
+			i = j;
+		}
+	}
+	d->index[i].key = NULL;
+	d->index[i].value = NULL;
+}
+
+/*
+ * (Re)build the index of 'd' with room for its keys, at most half full.
+ * On failure the old index is dropped.
+ */
+static int dict_index_build(struct bencode_dict *d)
+{
+	size_t size = 16;
 	size_t pos;
-	for (pos = 0; pos < d->n; pos++) {
-		if (ben_cmp(d->keys[pos], key) == 0)
-			return d->values[pos];
+
+	dict_index_drop(d);
+	while (size < 2 * (d->n + 1)) {
+		if (size > MAX_ALLOC)
+			return -1;
+		size *= 2;
 	}
-	return NULL;
+	if (d->arena == NULL) {
+		d->index = calloc(size, sizeof(d->index[0]));
+	} else {
+		d->index = ben_arena_alloc(d->arena, size * sizeof(d->index[0]));
+		if (d->index != NULL)
+			memset(d->index, 0, size * sizeof(d->index[0]));
+	}
+	if (d->index == NULL)
+		return -1;
+	d->index_size = size;
+	for (pos = 0; pos < d->n; pos++)
+		dict_index_put(d, d->keys[pos], d->values[pos]);
+	return 0;
 }
 
-struct bencode *ben_dict_get_by_str(const struct bencode *dict, const char *key)
+int ben_dict_index(struct bencode *dict)
+{
+	return dict_index_build(ben_dict_cast(dict));
+}
+
+/*
+ * Find 'key' in 'd'. Returns its position, or -1 if it is not there. If
+ * 'at' is not NULL, it is set to the position where the key is or would
+ * be inserted. The index holds no positions, so this is always a binary
+ * search.
+ */
+static size_t dict_find(const struct bencode_dict *d,
+			const struct bencode *key, size_t *at)
+{
+	size_t lo = 0;
+	size_t hi = d->n;
+	size_t mid;
+	int cmp;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		cmp = ben_cmp(d->keys[mid], key);
+		if (cmp == 0) {
+			if (at != NULL)
+				*at = mid;
+			return mid;
+		}
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (at != NULL)
+		*at = lo;
+	return -1;
+}
+
+struct bencode *ben_dict_get(const struct bencode *dict, const struct bencode *key)
 {
 	const struct bencode_dict *d = ben_dict_const_cast(dict);
-	size_t keylen = strlen(key);
-	struct bencode_str *dkey;
+	size_t mask = d->index_size - 1;
 	size_t pos;
-	for (pos = 0; pos < d->n; pos++) {
-		dkey = ben_str_cast(d->keys[pos]);
-		if (dkey == NULL)
-			continue;
-		if (dkey->len != keylen)
-			continue;
-		if (strcmp(dkey->s, key) == 0)
-			return d->values[pos];
+
+	if (d->index_size > 0) {
+		for (pos = hash_key(key) & mask; d->index[pos].key != NULL;
+		     pos = (pos + 1) & mask) {
+			if (ben_cmp(d->index[pos].key, key) == 0)
+				return d->index[pos].value;
+		}
+		return NULL;
 	}
-	return NULL;
+	pos = dict_find(d, key, NULL);
+	return pos != -1 ? d->values[pos] : NULL;
 }
 
-static void replacewithlast(struct bencode **arr, size_t i, size_t n)
+struct bencode *ben_dict_get_by_str(const struct bencode *dict, const char *key)
 {
-	arr[i] = arr[n - 1];
-	arr[n - 1] = NULL;
+	struct bencode_str skey = {.type = BENCODE_STR, .len = strlen(key),
+				   .s = (char *) key};
+	return ben_dict_get(dict, (struct bencode *) &skey);
 }
 
 struct bencode *ben_dict_pop(struct bencode *dict, const struct bencode *key)
 {
 	struct bencode_dict *d = ben_dict_cast(dict);
-	size_t pos;
-	for (pos = 0; pos < d->n; pos++) {
-		if (ben_cmp(d->keys[pos], key) == 0) {
-			struct bencode *value = d->values[pos];
-			ben_free(d->keys[pos]);
-			replacewithlast(d->keys, pos, d->n);
-			replacewithlast(d->values, pos, d->n);
-			d->n -= 1;
-			return value;
-		}
-	}
-	return NULL;
+	struct bencode *value;
+	size_t pos = dict_find(d, key, NULL);
+
+	if (pos == -1)
+		return NULL;
+	value = d->values[pos];
+	if (d->index_size > 0)
+		dict_index_del(d, d->keys[pos]);
+	drop(d->arena, d->keys[pos]);
+	/* Keep the keys sorted */
+	memmove(d->keys + pos, d->keys + pos + 1,
+		(d->n - pos - 1) * sizeof(d->keys[0]));
+	memmove(d->values + pos, d->values + pos + 1,
+		(d->n - pos - 1) * sizeof(d->values[0]));
+	d->n -= 1;
+	d->keys[d->n] = NULL;
+	d->values[d->n] = NULL;
+	return value;
 }
 
 int ben_dict_set(struct bencode *dict, struct bencode *key, struct bencode *value)
 {
 	struct bencode_dict *d = ben_dict_cast(dict);
+	size_t pos;
+	size_t at;
 
 	assert(d->n <= d->alloc);
+	pos = dict_find(d, key, &at);
+	if (pos != -1) {
+		/* The key stays where it is, and in the same index slot */
+		if (d->index_size > 0) {
+			at = dict_index_slot(d, d->keys[pos]);
+			d->index[at].key = key;
+			d->index[at].value = value;
+		}
+		drop(d->arena, d->keys[pos]);
+		drop(d->arena, d->values[pos]);
+		d->keys[pos] = key;
+		d->values[pos] = value;
+		return 0;
+	}
+
 	if (d->n == d->alloc && resize_dict(d))
 		return -1;
 
-	ben_free(ben_dict_pop(dict, key));
-
-	d->keys[d->n] = key;
-	d->values[d->n] = value;
+	memmove(d->keys + at + 1, d->keys + at,
+		(d->n - at) * sizeof(d->keys[0]));
+	memmove(d->values + at + 1, d->values + at,
+		(d->n - at) * sizeof(d->values[0]));
+	d->keys[at] = key;
+	d->values[at] = value;
 	d->n++;
+
+	if (d->index_size > 0) {
+		/* Only a full index is built again, in a bigger table */
+		if (2 * (d->n + 1) <= d->index_size)
+			dict_index_put(d, key, value);
+		else
+			dict_index_build(d);
+	}
 	return 0;
 }
 
 int ben_dict_set_by_str(struct bencode *dict, const char *key, struct bencode *value)
 {
-	struct bencode *bkey = ben_str(key);
+	struct ben_arena *arena = ben_dict_cast(dict)->arena;
+	struct bencode *bkey = ben_arena_str(arena, key);
 	if (bkey == NULL)
 		return -1;
 	if (ben_dict_set(dict, bkey, value)) {
-		ben_free(bkey);
+		drop(arena, bkey);
 		return -1;
 	}
 	return 0;
@@ -989,16 +1612,17 @@ int ben_dict_set_by_str(struct bencode *dict, const char *key, struct bencode *v
 
 int ben_dict_set_str_by_str(struct bencode *dict, const char *key, const char *value)
 {
-	struct bencode *bkey = ben_str(key);
-	struct bencode *bvalue = ben_str(value);
+	struct ben_arena *arena = ben_dict_cast(dict)->arena;
+	struct bencode *bkey = ben_arena_str(arena, key);
+	struct bencode *bvalue = ben_arena_str(arena, value);
 	if (bkey == NULL || bvalue == NULL) {
-		ben_free(bkey);
-		ben_free(bvalue);
+		drop(arena, bkey);
+		drop(arena, bvalue);
 		return -1;
 	}
 	if (ben_dict_set(dict, bkey, bvalue)) {
-		ben_free(bkey);
-		ben_free(bvalue);
+		drop(arena, bkey);
+		drop(arena, bvalue);
 		return -1;
 	}
 	return 0;
@@ -1006,7 +1630,12 @@ int ben_dict_set_str_by_str(struct bencode *dict, const char *key, const char *v
 
 struct bencode *ben_int(long long ll)
 {
-	struct bencode_int *b = alloc(BENCODE_INT);
+	return ben_arena_int(NULL, ll);
+}
+
+struct bencode *ben_arena_int(struct ben_arena *arena, long long ll)
+{
+	struct bencode_int *b = alloc(arena, BENCODE_INT);
 	if (b == NULL)
 		return NULL;
 	b->ll = ll;
@@ -1015,7 +1644,12 @@ struct bencode *ben_int(long long ll)
 
 struct bencode *ben_list(void)
 {
-	return alloc(BENCODE_LIST);
+	return alloc(NULL, BENCODE_LIST);
+}
+
+struct bencode *ben_arena_list(struct ben_arena *arena)
+{
+	return alloc(arena, BENCODE_LIST);
 }
 
 int ben_list_append(struct bencode *list, struct bencode *b)
@@ -1037,7 +1671,7 @@ void ben_list_set(struct bencode *list, size_t i, struct bencode *b)
 		fprintf(stderr, "bencode: ben_list_set() out of bounds: %zu\n", i);
 		abort();
 	}
-	ben_free(l->values[i]);
+	drop(l->arena, l->values[i]);
 	l->values[i] = b;
 }
 
@@ -1064,6 +1698,11 @@ struct bencode *ben_str(const char *s)
 	return ben_blob(s, strlen(s));
 }
 
+struct bencode *ben_arena_str(struct ben_arena *arena, const char *s)
+{
+	return ben_arena_blob(arena, s, strlen(s));
+}
+
 const char *ben_strerror(int error)
 {
 	switch (error) {
@@ -1075,8 +1714,194 @@ const char *ben_strerror(int error)
 		return "Insufficient amount of data (need more data)";
 	case BEN_NO_MEMORY:
 		return "Out of memory";
+	case BEN_STOPPED:
+		return "Stopped by a callback";
 	default:
 		fprintf(stderr, "Unknown error code: %d\n", error);
 		return NULL;
 	}
 }
+
+#ifdef BENCH_BENCODE
+
+#include <time.h>
+
+/*
+ * Decode throughput on pages like the ones NodeStore_dumpTable replies
+ * with, 4 nodes each, for each way of scanning digits. Build it with
+ * "make -f main.mk bench-bencode".
+ */
+#define BENCH_PAGES 1024
+#define BENCH_NODES 4
+#define BENCH_SECONDS 0.3
+
+static char *bench_pages[BENCH_PAGES];
+static size_t bench_lens[BENCH_PAGES];
+static size_t bench_bytes;
+
+static double bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Write C string 's' to 'buf' as a bencoded string */
+static int bench_str(char *buf, const char *s)
+{
+	return sprintf(buf, "%zu:%s", strlen(s), s);
+}
+
+static void bench_make_pages(void)
+{
+	char buf[2048];
+	char s[128];
+	size_t page;
+	int node;
+	int n;
+
+	srand(1);
+	for (page = 0; page < BENCH_PAGES; page++) {
+		n = sprintf(buf, "d5:counti%de4:morei1e5:peersi%de"
+			    "12:routingTablel", rand() % 5000, rand() % 40);
+		for (node = 0; node < BENCH_NODES; node++) {
+			sprintf(s, "v20.%04x.%04x.%04x.%04x.%.32s.k",
+				rand() & 0xffff, rand() & 0xffff,
+				rand() & 0xffff, rand() & 0xffff,
+				"0123456789bcdfghjklmnpqrstuvwxyz");
+			n += sprintf(buf + n, "d4:addr");
+			n += bench_str(buf + n, s);
+			n += sprintf(buf + n, "6:bucketi%de2:ip", rand() % 128);
+			sprintf(s, "fc%02x:%04x:%04x:%04x:%04x:%04x:%04x:%04x",
+				rand() & 0xff, rand() & 0xffff,
+				rand() & 0xffff, rand() & 0xffff,
+				rand() & 0xffff, rand() & 0xffff,
+				rand() & 0xffff, rand() & 0xffff);
+			n += bench_str(buf + n, s);
+			n += sprintf(buf + n, "4:linki%de4:path", rand());
+			sprintf(s, "%04x.%04x.%04x.%04x", 0, 0,
+				rand() & 0xffff, rand() & 0xffff);
+			n += bench_str(buf + n, s);
+			n += sprintf(buf + n, "4:timei%de7:versioni%dee",
+				     rand(), 18 + rand() % 3);
+		}
+		sprintf(s, "%zu", page + 1);
+		n += sprintf(buf + n, "e4:txid");
+		n += bench_str(buf + n, s);
+		n += sprintf(buf + n, "e");
+		bench_pages[page] = malloc(n);
+		if (bench_pages[page] == NULL)
+			abort();
+		memcpy(bench_pages[page], buf, n);
+		bench_lens[page] = n;
+		bench_bytes += n;
+	}
+}
+
+static int bench_count(void *arg)
+{
+	(*(size_t *) arg)++;
+	return 0;
+}
+
+static int bench_count_str(void *arg, const char *s, size_t len)
+{
+	return bench_count(arg);
+}
+
+static int bench_count_int(void *arg, long long ll)
+{
+	return bench_count(arg);
+}
+
+static const struct ben_parser bench_parser = {
+	.key = bench_count_str,
+	.str = bench_count_str,
+	.integer = bench_count_int,
+};
+
+enum {
+	BENCH_DECODE,
+	BENCH_VIEW,
+	BENCH_ARENA_VIEW,
+	BENCH_PARSE,
+	BENCH_WAYS,
+};
+
+/* Decode all the pages one way, over and over. Returns MB/s. */
+static double bench_run(int way)
+{
+	char space[4096];
+	struct ben_arena arena;
+	struct bencode *b;
+	size_t items = 0;
+	size_t bytes = 0;
+	size_t page;
+	double start = bench_now();
+	double elapsed;
+
+	ben_arena_init(&arena, space, sizeof(space));
+	do {
+		for (page = 0; page < BENCH_PAGES; page++) {
+			const char *data = bench_pages[page];
+			size_t len = bench_lens[page];
+			switch (way) {
+			case BENCH_DECODE:
+				b = ben_decode(data, len);
+				if (b == NULL)
+					abort();
+				ben_free(b);
+				break;
+			case BENCH_VIEW:
+				b = ben_decode_view(data, len);
+				if (b == NULL)
+					abort();
+				ben_free(b);
+				break;
+			case BENCH_ARENA_VIEW:
+				if (ben_arena_decode_view(&arena, data, len) == NULL)
+					abort();
+				ben_arena_release(&arena);
+				break;
+			case BENCH_PARSE:
+				if (ben_parse(data, len, &bench_parser, &items))
+					abort();
+				break;
+			}
+		}
+		bytes += bench_bytes;
+		elapsed = bench_now() - start;
+	} while (elapsed < BENCH_SECONDS);
+	return bytes / elapsed / 1e6;
+}
+
+static void bench_digits(const char *name,
+			 size_t (*fn)(const char *s, size_t len))
+{
+	int way;
+	digits = fn;
+	printf("%-8s", name);
+	for (way = 0; way < BENCH_WAYS; way++)
+		printf(" %12.1f", bench_run(way));
+	printf("\n");
+}
+
+int main(void)
+{
+	bench_make_pages();
+	printf("%d dumpTable pages of %d nodes, %zu bytes, MB/s:\n",
+	       BENCH_PAGES, BENCH_NODES, bench_bytes);
+	printf("%-8s %12s %12s %12s %12s\n", "digits", "decode", "view",
+	       "arena+view", "parse");
+	bench_digits("scalar", digits_scalar);
+#ifdef BEN_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		bench_digits("sse2", digits_sse2);
+	if (__builtin_cpu_supports("avx2"))
+		bench_digits("avx2", digits_avx2);
+#endif
+	return 0;
+}
+
+#endif
@@ -16,17 +16,30 @@ enum {
 	BEN_INVALID,      /* Invalid data was given to decoder */
 	BEN_INSUFFICIENT, /* Insufficient amount of data for decoding */
 	BEN_NO_MEMORY,    /* Memory allocation failed */
+	BEN_STOPPED,      /* A ben_parse() callback stopped parsing */
 };
 
 struct bencode {
 	char type;
 };
 
+struct ben_arena;
+
 struct bencode_bool {
 	char type;
 	char b;
 };
 
+/* A slot in the hash index of a dictionary */
+struct bencode_dict_slot {
+	struct bencode *key; /* NULL if empty */
+	struct bencode *value;
+};
+
+/*
+ * The keys of a dictionary are kept sorted, so they are found with binary
+ * search. A dictionary may also have a hash index from ben_dict_index().
+ */
 struct bencode_dict {
 	char type;
 	size_t n;
@@ -34,6 +47,9 @@ struct bencode_dict {
 	/* keys and values can be put into a same array, later */
 	struct bencode **keys;
 	struct bencode **values;
+	struct ben_arena *arena; /* NULL if allocated with malloc() */
+	struct bencode_dict_slot *index; /* by key hash */
+	size_t index_size; /* 0 if there is no index */
 };
 
 struct bencode_int {
@@ -46,10 +62,12 @@ struct bencode_list {
 	size_t n;
 	size_t alloc;
 	struct bencode **values;
+	struct ben_arena *arena; /* NULL if allocated with malloc() */
 };
 
 struct bencode_str {
 	char type;
+	char view; /* s points into decoded data, and is not zero terminated */
 	size_t len;
 	char *s;
 };
@@ -77,6 +95,119 @@ struct bencode *ben_decode(const void *data, size_t len);
  */
 struct bencode *ben_decode2(const void *data, size_t len, size_t *off, int *error);
 
+/*
+ * An arena holds bencode trees that are freed all at once with
+ * ben_arena_release(), instead of node by node with ben_free(). It starts
+ * with a buffer given by the caller, which may be NULL, and takes blocks
+ * from malloc() when that runs out.
+ *
+ * Nodes in an arena must not be given to ben_free(). Containers in an
+ * arena may only hold nodes of the same arena, and the values they
+ * replace or pop stay in the arena until it is released.
+ */
+struct ben_arena_block;
+
+struct ben_arena {
+	char *buf;   /* the caller's buffer */
+	size_t size;
+	char *p;     /* free space in the current block */
+	size_t left;
+	size_t next; /* size of the next block from malloc() */
+	struct ben_arena_block *blocks; /* newest first */
+};
+
+/* Initialize 'arena' to use 'size' bytes at 'buf' first */
+void ben_arena_init(struct ben_arena *arena, void *buf, size_t size);
+
+/* Allocate 'size' bytes from 'arena'. Returns NULL if out of memory. */
+void *ben_arena_alloc(struct ben_arena *arena, size_t size);
+
+/*
+ * Free all the trees in 'arena' at once, and make it empty. The arena can
+ * be used again. Its cost depends on the blocks taken from malloc(), not
+ * on the number of nodes.
+ */
+void ben_arena_release(struct ben_arena *arena);
+
+/*
+ * Same as ben_decode() and ben_decode2(), but the tree is allocated from
+ * 'arena'. If 'arena' is NULL they are the same as ben_decode() and
+ * ben_decode2(). Nothing needs to be freed on failure, but the parts
+ * decoded before the error use space in the arena until it is released.
+ */
+struct bencode *ben_arena_decode(struct ben_arena *arena, const void *data,
+				 size_t len);
+struct bencode *ben_arena_decode2(struct ben_arena *arena, const void *data,
+				  size_t len, size_t *off, int *error);
+
+/*
+ * Same as ben_decode() and ben_arena_decode(), but strings are not
+ * copied. They are views that point into 'data', so 'data' must stay
+ * alive and unchanged while the tree is used, or until the strings are
+ * copied with ben_materialize(). Views are not zero terminated.
+ */
+struct bencode *ben_decode_view(const void *data, size_t len);
+struct bencode *ben_arena_decode_view(struct ben_arena *arena,
+				      const void *data, size_t len);
+
+/*
+ * Copy the string views in 'b' into memory of their own, so 'b' no longer
+ * needs the data it was decoded from. ben_arena_materialize() copies them
+ * into 'arena', which must be the arena of 'b' (or NULL if 'b' is not in
+ * one). Returns 0 on success, -1 on failure (no memory). On failure some
+ * strings may be copied, and the tree is still valid.
+ */
+int ben_materialize(struct bencode *b);
+int ben_arena_materialize(struct ben_arena *arena, struct bencode *b);
+
+/* Same as ben_encode(), but the encoded data is allocated from 'arena' */
+void *ben_arena_encode(struct ben_arena *arena, size_t *len,
+		       const struct bencode *b);
+
+/*
+ * Same as ben_blob(), ben_bool(), ben_dict(), ben_int(), ben_list() and
+ * ben_str(), but the new node is allocated from 'arena', or with malloc()
+ * if 'arena' is NULL. Values added to an arena dict with
+ * ben_dict_set_by_str() or ben_dict_set_str_by_str() get their keys and
+ * values from the dict's arena.
+ */
+struct bencode *ben_arena_blob(struct ben_arena *arena, const void *data,
+			       size_t len);
+struct bencode *ben_arena_bool(struct ben_arena *arena, int b);
+struct bencode *ben_arena_dict(struct ben_arena *arena);
+struct bencode *ben_arena_int(struct ben_arena *arena, long long ll);
+struct bencode *ben_arena_list(struct ben_arena *arena);
+struct bencode *ben_arena_str(struct ben_arena *arena, const char *s);
+
+/*
+ * Callbacks for ben_parse(). Each is called as the decoder meets the
+ * corresponding item in the data, in order. Strings are passed as pointers
+ * into the data, which are not zero terminated. String keys of
+ * dictionaries go to key() and their values follow. (Integer keys, which
+ * the decoder also accepts, go to integer().) Any callback may be NULL.
+ * A callback returning non-zero stops parsing with BEN_STOPPED.
+ */
+struct ben_parser {
+	int (*dict_begin)(void *arg);
+	int (*dict_end)(void *arg);
+	int (*list_begin)(void *arg);
+	int (*list_end)(void *arg);
+	int (*key)(void *arg, const char *s, size_t len);
+	int (*str)(void *arg, const char *s, size_t len);
+	int (*integer)(void *arg, long long ll);
+	int (*boolean)(void *arg, int b);
+};
+
+/*
+ * Decode 'data' with 'len' bytes of data without building a tree,
+ * calling the callbacks in 'parser' with 'arg' for each item instead.
+ * Nothing is allocated. The data is checked as strictly as ben_decode()
+ * checks it, but callbacks may have been called for items before an error
+ * is found. Returns BEN_OK, or an error as ben_decode2() reports them.
+ */
+int ben_parse(const void *data, size_t len, const struct ben_parser *parser,
+	      void *arg);
+
 /*
  * ben_cmp() is similar to strcmp(), but compares both integers and strings.
  * An integer is always less than a string.
@@ -117,7 +248,8 @@ struct bencode *ben_dict(void);
 
 /*
  * Try to locate 'key' in dictionary. Returns the associated value, if found.
- * Returns NULL if the key does not exist.
+ * Returns NULL if the key does not exist. Takes O(log n) time, or O(1)
+ * with a hash index.
  */
 struct bencode *ben_dict_get(const struct bencode *d, const struct bencode *key);
 
@@ -125,11 +257,20 @@ struct bencode *ben_dict_get_by_str(const struct bencode *d, const char *key);
 
 /*
  * Try to locate 'key' in dictionary. Returns the associated value, if found.
- * The value must be later freed with ben_free(). Returns NULL if the key
- * does not exist.
+ * The value must be later freed with ben_free(), unless the dictionary is
+ * in an arena. Returns NULL if the key does not exist.
  */
 struct bencode *ben_dict_pop(struct bencode *d, const struct bencode *key);
 
+/*
+ * Build a hash index for dictionary 'd', so lookups take O(1) time instead
+ * of O(log n). This pays off for big dictionaries with many lookups. The
+ * index is kept up to date as keys are set and popped, and is only built
+ * again when it grows. It is freed with the dictionary. Returns 0 on
+ * success, -1 on failure (no memory).
+ */
+int ben_dict_index(struct bencode *d);
+
 /*
  * Set 'key' in dictionary to be 'value'. An old value exists for the key
  * is freed if it exists. 'key' and 'value' are owned by the dictionary
@@ -285,6 +426,12 @@ static inline size_t ben_str_len(const struct bencode *b)
 	return ben_str_const_cast(b)->len;
 }
 
+/* Return 1 iff string 'b' is a view into decoded data */
+static inline int ben_str_is_view(const struct bencode *b)
+{
+	return ben_str_const_cast(b)->view;
+}
+
 /* Return boolean value (0 or 1) of 'b' */
 static inline int ben_bool_val(const struct bencode *b)
 {
@@ -298,8 +445,8 @@ static inline long long ben_int_val(const struct bencode *b)
 }
 
 /*
- * Note: the string is always zero terminated. Also, the string may
- * contain more than one zero.
+ * Note: the string is zero terminated, unless it is a view from
+ * ben_decode_view(). Also, the string may contain more than one zero.
  * bencode strings are not compatible with C strings.
  */
 static inline const char *ben_str_val(const struct bencode *b)
@@ -17,6 +17,9 @@ endif
 $(BIN):: $(OBJ)
 	${CC} -o $@ $^ ${LDFLAGS}
 
+bench-bencode: deps/bencode/bencode.c deps/bencode/bencode.h
+	${CC} ${CFLAGS} -O2 -DBENCH_BENCODE -o $@ $<
+
 .c.o:
 	${CC} -c ${CFLAGS} $< -o $@
 
@@ -27,7 +30,7 @@ uninstall:
 	rm -f ${DESTDIR}${BINDIR}/${BIN}
 
 clean:
-	rm -f $(BIN) $(OBJ)
+	rm -f $(BIN) $(OBJ) bench-bencode
 
 .PHONY: all install uninstall
 
@@ -13,11 +13,57 @@
 #include <arpa/inet.h>
 #include <sys/select.h>
 #include "bencode/bencode.h"
+#include "hash/khash.h"
 #include "cjdnsadmin.h"
 #include "util.h"
 
 #define CJDNSADMIN_PORT "11234"
 #define CJDNSADMIN_HOST "127.0.0.1"
+#define CJDNSADMIN_PIPELINE 4 // routing table pages requested at once
+#define CJDNSADMIN_QUERY_LEN 256
+#define CJDNSADMIN_ARENA_LEN 1024 // to build a query in
+// queries are sent again if not answered in CJDNSADMIN_RTO ms, doubling
+// each time, and given up on after CJDNSADMIN_TRIES sends. at most
+// CJDNSADMIN_REQUESTS can be waiting for replies
+#define CJDNSADMIN_RTO 100
+#define CJDNSADMIN_TRIES 5
+#define CJDNSADMIN_REQUESTS 16
+#define CJDNSADMIN_RETRY_TICK 20 // ms
+// nodes are reported lost once this many complete dumps leave them out
+#define CJDNSADMIN_LOST_DUMPS 2
+
+// called with the bencoded reply to a query, already checked to be well
+// formed, or with NULL if none came
+typedef void (*reply_cb)(cjdnsadmin_t *adm, const char *reply, size_t len,
+        void *arg);
+
+// a query waiting for its reply
+struct request {
+    unsigned int txid; // 0 if unused
+    char msg[CJDNSADMIN_QUERY_LEN];
+    size_t len;
+    unsigned int tries;
+    uint64_t deadline;
+    reply_cb cb;
+    void *arg;
+};
+
+// a node in the routing table, as of the dump it was last listed in.
+// they are kept in the order they were last listed, oldest first
+struct route {
+    struct in6_addr addr;
+    unsigned int generation;
+    struct route *prev;
+    struct route *next;
+};
+
+KHASH_INIT(route, struct in6_addr, struct route *, 1, in6_hash, in6_equal)
+
+// a copy of a query on its way out
+struct query {
+    uv_udp_send_t req;
+    char msg[CJDNSADMIN_QUERY_LEN];
+};
 
 struct cjdnsadmin {
     uv_udp_t handle;
@@ -26,15 +72,41 @@ struct cjdnsadmin {
     const char *host;
     const char *port;
 
-    int fetch_peers_page;
+    struct request requests[CJDNSADMIN_REQUESTS];
+    size_t requests_n;
+    unsigned int txid;  // last one used
+    uv_timer_t retry_timer;
+    unsigned long retransmits;
+    unsigned long timeouts;
+    unsigned long unmatched;    // replies to no query we are waiting on
+
+    // routing table dump. pages are requested ahead of the replies
+    int dumping;
+    int next_page;      // to request next
+    int last_page;      // first page found to have no more after it, or -1
+    unsigned int pages_out;
+    int failed_page;    // first page that got no reply, or -1
+    uint64_t dump_start;
+    size_t dump_pages;
+    size_t dump_ips;
+    size_t dump_added;
+
+    // the routing table as of the last dumps
+    khash_t(route) *routes;
+    struct route *routes_head;
+    struct route *routes_tail;
+    unsigned int generation;    // of the current dump. only whole ones count
 
     struct sockaddr* theaddr;
 
     on_found_ip_t on_found_ip;
     void *on_found_ip_obj;
+    on_found_ip_t on_lost_ip;
+    void *on_lost_ip_obj;
 };
 
 void handle_message(cjdnsadmin_t *adm, char *buffer, ssize_t len);
+static void retry_tick(uv_timer_t *timer);
 
 cjdnsadmin_t *cjdnsadmin_new() {
     cjdnsadmin_t *adm = calloc(1, sizeof(cjdnsadmin_t));
@@ -45,12 +117,26 @@ cjdnsadmin_t *cjdnsadmin_new() {
 
     adm->port = CJDNSADMIN_PORT;
     adm->host = CJDNSADMIN_HOST;
-    adm->fetch_peers_page = 0;
+    adm->last_page = -1;
+    adm->failed_page = -1;
+    adm->routes = kh_init(route);
+    if (!adm->routes) {
+        free(adm);
+        return NULL;
+    }
 
     return adm;
 }
 
 void cjdnsadmin_free(cjdnsadmin_t *adm) {
+    struct route *route, *next;
+    for (route = adm->routes_head; route; route = next) {
+        next = route->next;
+        free(route);
+    }
+    kh_destroy(route, adm->routes);
+    free(adm->theaddr);
+    free(adm->buffer);
     free(adm);
 }
 
@@ -58,9 +144,9 @@ void cjdnsadmin_free(cjdnsadmin_t *adm) {
 void on_read(uv_udp_t* stream, ssize_t nread, const uv_buf_t* buf,
         const struct sockaddr* addr, unsigned flags) {
     if(nread < 0) {
-        perror("uh");
-        fprintf(stderr,"error: %s %s %ld %d\n",uv_strerror(nread),uv_err_name(nread),nread,EOF);
-        exit(99);
+        // lost replies are sent for again
+        fprintf(stderr, "cjdns admin read error: %s\n", uv_strerror(nread));
+        return;
     }
     if(nread == 0) return;
     handle_message(stream->data,buf->base,nread);
@@ -99,72 +185,534 @@ void cjdnsadmin_start(cjdnsadmin_t *adm) {
     memcpy(adm->theaddr, res->ai_addr, res->ai_addrlen);
 
     freeaddrinfo(res);
+    uv_timer_init(uv_default_loop(), &adm->retry_timer);
+    adm->retry_timer.data = adm;
     uv_udp_recv_start(&adm->handle,alloc_buffer,on_read);
 }
 
 static void on_written(uv_udp_send_t* req, int status) {
-    CHECK(status);
-    struct bencode* b = req->data;
-    ben_free(b);
+    if (status < 0) {
+        // it will be sent again if need be
+        fprintf(stderr, "cjdns admin send error: %s\n", uv_strerror(status));
+    }
+    free(req->data);
+}
+
+static void
+transmit(cjdnsadmin_t *adm, struct request *req) {
+    struct query *query = malloc(sizeof(struct query));
+    uv_buf_t buf;
+
+    if (!query) {
+        perror("malloc");
+        return;
+    }
+    memcpy(query->msg, req->msg, req->len);
+    buf.base = query->msg;
+    buf.len = req->len;
+    query->req.data = query;
+    if (uv_udp_send(&query->req, &adm->handle, &buf, 1, adm->theaddr,
+                on_written) < 0) {
+        free(query);
+    }
+}
+
+// send a query, tagged with a txid to match the reply to it. cb is called
+// with the reply, or with NULL once the tries run out. returns -1 if too
+// many queries are waiting, or if the query can't be built
+static int
+send_query(cjdnsadmin_t *adm, struct bencode *b, reply_cb cb, void *arg) {
+    char txid_str[16];
+    struct request *req = NULL;
+    size_t i;
+
+    for (i = 0; i < CJDNSADMIN_REQUESTS; i++) {
+        if (!adm->requests[i].txid) {
+            req = &adm->requests[i];
+            break;
+        }
+    }
+    if (!req) {
+        return -1;
+    }
+    if (!++adm->txid) {
+        adm->txid++;
+    }
+    snprintf(txid_str, sizeof(txid_str), "%u", adm->txid);
+    if (ben_dict_set_str_by_str(b, "txid", txid_str) < 0) {
+        // without it, no reply could be matched to the query
+        return -1;
+    }
+    req->len = ben_encode2(req->msg, sizeof(req->msg), b);
+    if (!req->len) {
+        return -1;
+    }
+    req->txid = adm->txid;
+    req->tries = 1;
+    req->deadline = uv_now(uv_default_loop()) + CJDNSADMIN_RTO;
+    req->cb = cb;
+    req->arg = arg;
+    if (!adm->requests_n++) {
+        uv_timer_start(&adm->retry_timer, retry_tick,
+                CJDNSADMIN_RETRY_TICK, CJDNSADMIN_RETRY_TICK);
+    }
+    transmit(adm, req);
+    return 0;
+}
+
+// free a request's slot, then tell its caller how it went
+static void
+finish_request(cjdnsadmin_t *adm, struct request *req,
+        const char *reply, size_t len) {
+    reply_cb cb = req->cb;
+    void *arg = req->arg;
+    req->txid = 0;
+    if (!--adm->requests_n) {
+        uv_timer_stop(&adm->retry_timer);
+    }
+    cb(adm, reply, len, arg);
+}
+
+// send queries again whose replies are late, backing off each time
+static void
+retry_tick(uv_timer_t *timer) {
+    cjdnsadmin_t *adm = timer->data;
+    uint64_t now = uv_now(uv_default_loop());
+    size_t i;
+    for (i = 0; i < CJDNSADMIN_REQUESTS; i++) {
+        struct request *req = &adm->requests[i];
+        if (!req->txid || now < req->deadline) {
+            continue;
+        }
+        if (req->tries == CJDNSADMIN_TRIES) {
+            adm->timeouts++;
+            finish_request(adm, req, NULL, 0);
+            continue;
+        }
+        req->deadline = now + ((uint64_t)CJDNSADMIN_RTO << req->tries);
+        req->tries++;
+        adm->retransmits++;
+        transmit(adm, req);
+    }
+}
+
+static void page_reply(cjdnsadmin_t *adm, const char *reply, size_t len,
+        void *arg);
+
+// ask for the next page of the routing table
+static int
+request_page(cjdnsadmin_t *adm) {
+    char space[CJDNSADMIN_ARENA_LEN];
+    struct ben_arena arena;
+    struct bencode *b, *args;
+    int ret;
+
+    // the query is built on the stack, and freed at once
+    ben_arena_init(&arena, space, sizeof(space));
+    b = ben_arena_dict(&arena);
+    args = ben_arena_dict(&arena);
+    if (!b || !args) {
+        ben_arena_release(&arena);
+        return -1;
+    }
+    ben_dict_set(b, ben_arena_str(&arena, "q"),
+            ben_arena_str(&arena, "NodeStore_dumpTable"));
+    ben_dict_set(b, ben_arena_str(&arena, "args"), args);
+    ben_dict_set(args, ben_arena_str(&arena, "page"),
+            ben_arena_int(&arena, adm->next_page));
+
+    ret = send_query(adm, b, page_reply, (void *)(intptr_t)adm->next_page);
+    ben_arena_release(&arena);
+    if (ret < 0) {
+        return -1;
+    }
+    adm->next_page++;
+    adm->pages_out++;
+    return 0;
 }
 
+// start dumping the routing table, with several pages in flight
 void cjdnsadmin_fetch_peers(cjdnsadmin_t *adm)
 {
-    struct bencode *b = ben_dict();
-    struct bencode *args = ben_dict();
-    // TODO: fix memory leak
-    ben_dict_set(b, ben_str("q"), ben_str("NodeStore_dumpTable"));
-    ben_dict_set(b, ben_str("args"), args);
-    ben_dict_set(args, ben_str("page"), ben_int(adm->fetch_peers_page));
-
-    uv_buf_t buf;
-    static char msg[256];
-    buf.base = msg;
-    buf.len = ben_encode2(msg, sizeof msg, b);
+    size_t i;
+    if (adm->dumping) {
+        // the last one is still going. it ends when its queries time out
+        return;
+    }
+    adm->dumping = 1;
+    adm->next_page = 0;
+    adm->last_page = -1;
+    adm->failed_page = -1;
+    adm->dump_start = uv_now(uv_default_loop());
+    adm->dump_pages = 0;
+    adm->dump_ips = 0;
+    adm->dump_added = 0;
+    adm->generation++;
+    for (i = 0; i < CJDNSADMIN_PIPELINE; i++) {
+        if (request_page(adm) < 0) {
+            break;
+        }
+    }
+    if (!adm->pages_out) {
+        adm->dumping = 0;
+        adm->generation--;
+    }
+}
 
-    AMNEW(uv_udp_send_t,writer);
-    writer->data = b;
-    uv_udp_send(writer,
-            &adm->handle,
-            &buf,1,
-            adm->theaddr,
-            on_written);
+static void
+route_unlink(cjdnsadmin_t *adm, struct route *route) {
+    if (route->prev) {
+        route->prev->next = route->next;
+    } else {
+        adm->routes_head = route->next;
+    }
+    if (route->next) {
+        route->next->prev = route->prev;
+    } else {
+        adm->routes_tail = route->prev;
+    }
+}
 
+static void
+route_append(cjdnsadmin_t *adm, struct route *route) {
+    route->prev = adm->routes_tail;
+    route->next = NULL;
+    if (adm->routes_tail) {
+        adm->routes_tail->next = route;
+    } else {
+        adm->routes_head = route;
+    }
+    adm->routes_tail = route;
 }
 
-void handle_message(cjdnsadmin_t *adm, char *buffer, ssize_t len) {
-    // TODO: fix memory leak
-    struct bencode *b = ben_decode(buffer, len);
-    if (!b) {
-        fprintf(stderr, "bencode error: %lu\n",len);
-        printf("message from cjdns: \"%*s\"\n", (int)len, buffer);
+// note a node listed in this dump, telling about it only if it is new
+static void
+route_seen(cjdnsadmin_t *adm, const char *ip) {
+    struct in6_addr addr;
+    struct route *route;
+    khiter_t k;
+    int ret;
+
+    if (inet_pton(AF_INET6, ip, &addr) != 1) {
+        return;
+    }
+    k = kh_put(route, adm->routes, addr, &ret);
+    if (ret < 0) {
+        perror("kh_put");
+        return;
+    }
+    if (!ret) {
+        route = kh_value(adm->routes, k);
+        if (route->generation != adm->generation) {
+            route->generation = adm->generation;
+            route_unlink(adm, route);
+            route_append(adm, route);
+        }
         return;
     }
-    // Get IPs
-    struct bencode *table = ben_dict_get_by_str(b, "routingTable");
-    size_t i, num_items = ben_list_len(table);
-    for (i = 0; i < num_items; i++) {
-        struct bencode *item = ben_list_get(table, i);
-        struct bencode *ip = ben_dict_get_by_str(item, "ip");
-        if (ben_is_str(ip)) {
-            const char *ip_str = ben_str_val(ip);
-            if (adm->on_found_ip) {
-                (*adm->on_found_ip)(adm->on_found_ip_obj, ip_str);
+    route = malloc(sizeof(struct route));
+    if (!route) {
+        perror("malloc");
+        kh_del(route, adm->routes, k);
+        return;
+    }
+    route->addr = addr;
+    route->generation = adm->generation;
+    route_append(adm, route);
+    kh_value(adm->routes, k) = route;
+    adm->dump_added++;
+    if (adm->on_found_ip) {
+        (*adm->on_found_ip)(adm->on_found_ip_obj, &addr);
+    }
+}
+
+// after a complete dump, drop the nodes it and the ones before left out.
+// they are at the head of the list, so this only looks at them
+static size_t
+routes_expire(cjdnsadmin_t *adm) {
+    struct route *route;
+    size_t lost = 0;
+    while ((route = adm->routes_head) && adm->generation -
+            route->generation >= CJDNSADMIN_LOST_DUMPS) {
+        khiter_t k = kh_get(route, adm->routes, route->addr);
+        if (k != kh_end(adm->routes)) {
+            kh_del(route, adm->routes, k);
+        }
+        route_unlink(adm, route);
+        if (adm->on_lost_ip) {
+            (*adm->on_lost_ip)(adm->on_lost_ip_obj, &route->addr);
+        }
+        free(route);
+        lost++;
+    }
+    return lost;
+}
+
+// what the value after the last dict key is
+enum page_key {
+    PAGE_KEY_NONE,
+    PAGE_KEY_TABLE, // routingTable, at the top
+    PAGE_KEY_MORE,  // more, at the top
+    PAGE_KEY_IP,    // ip, in an entry of the routing table
+};
+
+// picking the ips and more out of a page as it is parsed, so nothing is
+// allocated for the parts of the entries we don't use
+struct page_parse {
+    cjdnsadmin_t *adm;
+    int depth;          // of the containers we are in
+    int in_table;       // the routing table is one of them
+    enum page_key key;
+    int more;
+};
+
+#define PAGE_KEY_IS(s, len, name) \
+    ((len) == sizeof(name) - 1 && !memcmp((s), (name), (len)))
+
+static int
+page_key(void *arg, const char *s, size_t len) {
+    struct page_parse *p = arg;
+    p->key = PAGE_KEY_NONE;
+    if (p->depth == 1) {
+        if (PAGE_KEY_IS(s, len, "routingTable")) {
+            p->key = PAGE_KEY_TABLE;
+        } else if (PAGE_KEY_IS(s, len, "more")) {
+            p->key = PAGE_KEY_MORE;
+        }
+    } else if (p->depth == 3 && p->in_table && PAGE_KEY_IS(s, len, "ip")) {
+        p->key = PAGE_KEY_IP;
+    }
+    return 0;
+}
+
+static int
+page_begin(void *arg) {
+    struct page_parse *p = arg;
+    p->key = PAGE_KEY_NONE;
+    p->depth++;
+    return 0;
+}
+
+static int
+page_list_begin(void *arg) {
+    struct page_parse *p = arg;
+    if (p->depth == 1 && p->key == PAGE_KEY_TABLE) {
+        p->in_table = 1;
+    }
+    return page_begin(arg);
+}
+
+static int
+page_end(void *arg) {
+    struct page_parse *p = arg;
+    if (--p->depth == 1) {
+        p->in_table = 0;
+    }
+    return 0;
+}
+
+static int
+page_str(void *arg, const char *s, size_t len) {
+    struct page_parse *p = arg;
+    char ip[INET6_ADDRSTRLEN];
+    if (p->key == PAGE_KEY_IP && len < sizeof(ip)) {
+        memcpy(ip, s, len);
+        ip[len] = '\0';
+        p->adm->dump_ips++;
+        route_seen(p->adm, ip);
+    }
+    p->key = PAGE_KEY_NONE;
+    return 0;
+}
+
+static int
+page_int(void *arg, long long ll) {
+    struct page_parse *p = arg;
+    if (p->key == PAGE_KEY_MORE) {
+        p->more = ll != 0;
+    }
+    p->key = PAGE_KEY_NONE;
+    return 0;
+}
+
+static int
+page_bool(void *arg, int b) {
+    struct page_parse *p = arg;
+    p->key = PAGE_KEY_NONE;
+    return 0;
+}
+
+static const struct ben_parser page_parser = {
+    .dict_begin = page_begin,
+    .dict_end = page_end,
+    .list_begin = page_list_begin,
+    .list_end = page_end,
+    .key = page_key,
+    .str = page_str,
+    .integer = page_int,
+    .boolean = page_bool,
+};
+
+// a page of the routing table came in, or didn't
+static void
+page_reply(cjdnsadmin_t *adm, const char *reply, size_t len, void *arg) {
+    int page = (intptr_t)arg;
+
+    adm->pages_out--;
+    if (!reply) {
+        // cjdns isn't answering. don't ask for more. pages past the end
+        // were only asked for ahead of knowing where it is
+        if (adm->last_page < 0 || page < adm->last_page) {
+            fprintf(stderr, "cjdns admin: no reply for routing table "
+                    "page %d\n", page);
+            if (adm->failed_page < 0 || page < adm->failed_page) {
+                adm->failed_page = page;
             }
         }
+    } else {
+        struct page_parse p = {.adm = adm};
+
+        adm->dump_pages++;
+        // get the ips, and check if there is more
+        ben_parse(reply, len, &page_parser, &p);
+        if (!p.more && (adm->last_page < 0 || page < adm->last_page)) {
+            adm->last_page = page;
+        }
+    }
+
+    if (adm->last_page < 0 && adm->failed_page < 0) {
+        // keep the pipeline full until we find the end
+        request_page(adm);
+    }
+    if (!adm->pages_out) {
+        // an incomplete dump can't tell which nodes are gone. it is whole
+        // if every page up to the end came in, whatever came after it
+        int complete = adm->last_page >= 0 && (adm->failed_page < 0 ||
+                adm->failed_page > adm->last_page);
+        size_t lost = complete ? routes_expire(adm) : 0;
+        if (!complete) {
+            // the next dump takes its place, so that a node this one
+            // missed isn't counted as left out of a dump
+            adm->generation--;
+        }
+        adm->dumping = 0;
+        printf("routing table: %zu ips in %zu pages, %llu ms, "
+                "%zu new, %zu lost, %u known, "
+                "%lu retransmits, %lu timeouts\n",
+                adm->dump_ips, adm->dump_pages, (unsigned long long)
+                (uv_now(uv_default_loop()) - adm->dump_start),
+                adm->dump_added, lost, kh_size(adm->routes),
+                adm->retransmits, adm->timeouts);
+    }
+}
+
+// finding the txid at the top of a reply
+struct txid_parse {
+    int depth;
+    int is_txid;    // the next value is it
+    char txid[16];  // empty if there was none
+};
+
+static int
+txid_begin(void *arg) {
+    struct txid_parse *p = arg;
+    p->is_txid = 0;
+    p->depth++;
+    return 0;
+}
+
+static int
+txid_end(void *arg) {
+    struct txid_parse *p = arg;
+    p->depth--;
+    return 0;
+}
+
+static int
+txid_key(void *arg, const char *s, size_t len) {
+    struct txid_parse *p = arg;
+    p->is_txid = p->depth == 1 && len == 4 && !memcmp(s, "txid", 4);
+    return 0;
+}
+
+static int
+txid_str(void *arg, const char *s, size_t len) {
+    struct txid_parse *p = arg;
+    if (p->is_txid && len < sizeof(p->txid)) {
+        memcpy(p->txid, s, len);
+        p->txid[len] = '\0';
+    }
+    p->is_txid = 0;
+    return 0;
+}
+
+static int
+txid_other(void *arg) {
+    struct txid_parse *p = arg;
+    p->is_txid = 0;
+    return 0;
+}
+
+static int
+txid_int(void *arg, long long ll) {
+    return txid_other(arg);
+}
+
+static int
+txid_bool(void *arg, int b) {
+    return txid_other(arg);
+}
+
+static const struct ben_parser txid_parser = {
+    .dict_begin = txid_begin,
+    .dict_end = txid_end,
+    .list_begin = txid_begin,
+    .list_end = txid_end,
+    .key = txid_key,
+    .str = txid_str,
+    .integer = txid_int,
+    .boolean = txid_bool,
+};
+
+static struct request *
+find_request(cjdnsadmin_t *adm, const char *txid) {
+    unsigned long n;
+    char *end;
+    size_t i;
+    if (!*txid) {
+        return NULL;
+    }
+    n = strtoul(txid, &end, 10);
+    if (*end || !n) {
+        return NULL;
+    }
+    for (i = 0; i < CJDNSADMIN_REQUESTS; i++) {
+        if (adm->requests[i].txid == n) {
+            return &adm->requests[i];
+        }
+    }
+    return NULL;
+}
+
+// match a reply to its query. this pass checks the whole reply, so the
+// query's callback can pick out what it needs in a second pass
+void handle_message(cjdnsadmin_t *adm, char *buffer, ssize_t len) {
+    struct txid_parse p = {0};
+    struct request *req;
+    int err = ben_parse(buffer, len, &txid_parser, &p);
+    if (err != BEN_OK) {
+        fprintf(stderr, "bencode error: %s, %zd bytes\n", ben_strerror(err),
+                len);
+        printf("message from cjdns: \"%.*s\"\n", (int)len, buffer);
+        return;
     }
-    // check if there is more
-    struct bencode *more = ben_dict_get_by_str(b, "more");
-    int more_int = more && ben_is_int(more) && ben_int_val(more);
-    if (more_int == 1) {
-        // get the next page of the routing table
-        adm->fetch_peers_page++;
-        cjdnsadmin_fetch_peers(adm);
+    req = find_request(adm, p.txid);
+    if (!req) {
+        // a duplicate, or late after we gave up
+        adm->unmatched++;
     } else {
-        // start from the first page next time
-        adm->fetch_peers_page = 0;
+        finish_request(adm, req, buffer, len);
     }
-    ben_free(b);
 }
 
 void
@@ -172,3 +720,27 @@ cjdnsadmin_on_found_ip(cjdnsadmin_t *adm, on_found_ip_t cb, void *obj) {
     adm->on_found_ip = cb;
     adm->on_found_ip_obj = obj;
 }
+
+void
+cjdnsadmin_on_lost_ip(cjdnsadmin_t *adm, on_found_ip_t cb, void *obj) {
+    adm->on_lost_ip = cb;
+    adm->on_lost_ip_obj = obj;
+}
+
+int
+cjdnsadmin_has_route(cjdnsadmin_t *adm, const struct in6_addr *ip) {
+    return kh_get(route, adm->routes, *ip) != kh_end(adm->routes);
+}
+
+void
+cjdnsadmin_forget(cjdnsadmin_t *adm, const struct in6_addr *ip) {
+    khiter_t k = kh_get(route, adm->routes, *ip);
+    struct route *route;
+    if (k == kh_end(adm->routes)) {
+        return;
+    }
+    route = kh_value(adm->routes, k);
+    kh_del(route, adm->routes, k);
+    route_unlink(adm, route);
+    free(route);
+}
@@ -6,9 +6,13 @@
 #ifndef CJDNSADMIN_H
 #define CJDNSADMIN_H
 
+#include <netinet/in.h>
+#include <sys/select.h>
+
 typedef struct cjdnsadmin cjdnsadmin_t;
 
-typedef void (*on_found_ip_t) (void *obj, const char *ip);
+// a node was added to or dropped from the routing table
+typedef void (*on_found_ip_t) (void *obj, const struct in6_addr *ip);
 
 cjdnsadmin_t *cjdnsadmin_new();
 
@@ -24,6 +28,18 @@ void cjdnsadmin_add_select_descriptors(cjdnsadmin_t *adm, fd_set *in_set,
 void cjdnsadmin_process_select_descriptors(cjdnsadmin_t *adm, fd_set *in_set,
         fd_set *out_set);
 
+// cb is called for nodes new to the routing table since the last dump
 void cjdnsadmin_on_found_ip(cjdnsadmin_t *adm, on_found_ip_t cb, void *obj);
 
+// cb is called for nodes missing from the last CJDNSADMIN_LOST_DUMPS complete
+// dumps
+void cjdnsadmin_on_lost_ip(cjdnsadmin_t *adm, on_found_ip_t cb, void *obj);
+
+// whether a node was in the routing table as of the last dumps
+int cjdnsadmin_has_route(cjdnsadmin_t *adm, const struct in6_addr *ip);
+
+// forget a node, so it is reported as found again if the next dump lists
+// it. for nodes the caller dropped while cjdns still knows them
+void cjdnsadmin_forget(cjdnsadmin_t *adm, const struct in6_addr *ip);
+
 #endif /* CJDNSADMIN_H */
@@ -733,6 +733,15 @@ ircd_nick(ircd_t *ircd, struct irc_prefix *prefix, const char *nick) {
     }
 }
 
+// tell clients that a message target isn't known
+void
+ircd_no_such_nick(ircd_t *ircd, const char *target) {
+    for (struct irc_session *sess = ircd->session_list; sess; sess = sess->next) {
+        ircd_send(sess, &ircd->prefix, noAction,
+                "401 %s %s :No such nick/channel", ircd->nick, target);
+    }
+}
+
 // give a client a name list reply
 void
 irc_session_names(struct irc_session *session, struct irc_prefix
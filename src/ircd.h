@@ -64,6 +64,8 @@ void ircd_notice(ircd_t *ircd, struct irc_prefix *prefix, const char *target,
 
 void ircd_nick(ircd_t *ircd, struct irc_prefix *prefix, const char *nick);
 
+void ircd_no_such_nick(ircd_t *ircd, const char *target);
+
 size_t ircd_get_channels(ircd_t *ircd, char *buffer, size_t buf_len);
 
 #endif /* IRCD_H */
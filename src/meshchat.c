@@ -3,6 +3,8 @@
  * meshchat.c
  */
 
+#define _GNU_SOURCE // sendmmsg, recvmmsg
+
 #include <uv.h>
 
 #include <stdlib.h>
@@ -11,26 +13,303 @@
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/select.h>
+#include <sys/socket.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <ifaddrs.h>
 #include <time.h>
+#include <stdint.h>
 #include "ircd.h"
 #include "hash/hash.h"
 #include "meshchat.h"
 #include "cjdnsadmin.h"
 #include "util.h"
+#include "wire.h"
+#include "timerwheel.h"
+#include "peerstore.h"
 
 #define MESHCHAT_PORT 14627
 #define MESHCHAT_PACKETLEN 1400
 #define MESHCHAT_PEERFETCH_INTERVAL 600
-#define MESHCHAT_PEERSERVICE_INTERVAL 60
+#define MESHCHAT_WHEEL_TICK 100 // ms, resolution of peer deadlines
+// greetings are spread out: new peers are first greeted at a random point
+// in the ping interval, each interval varies by up to this percent, and
+// at most MESHCHAT_GREET_BURST are sent per tick
+#define MESHCHAT_GREET_JITTER 10
+#define MESHCHAT_GREET_BURST 50
+// a full greeting asked for by a peer goes out with their next greeting,
+// brought forward to at most this many seconds after the last one
+#define MESHCHAT_GREET_REQ_INTERVAL 1
 #define MESHCHAT_TIMEOUT 60
 #define MESHCHAT_PING_INTERVAL 20
 #define MESHCHAT_RETRY_INTERVAL 900
+// peers unheard from for MESHCHAT_EVICT_AGE seconds, and gone from the
+// cjdns routing table, are dropped. past MESHCHAT_PEERS_MAX, the stalest
+// of MESHCHAT_EVICT_SAMPLE random peers is dropped to make room. active
+// peers are never dropped
+#define MESHCHAT_EVICT_AGE 86400
+#define MESHCHAT_PEERS_MAX 100000
+#define MESHCHAT_EVICT_SAMPLE 8
+#define MESHCHAT_SEND_BATCH 64
+#define MESHCHAT_RECV_BATCH 32 // 1 disables batched receive
+#define MESHCHAT_POOL_SLAB 64
+
+// per-destination framing put in front of an encoded event
+#define MESHCHAT_HDR_MAX 13
+#define MESHCHAT_PAYLOAD_LEN (MESHCHAT_PACKETLEN - MESHCHAT_HDR_MAX)
+
+// reliability layer. times are in milliseconds
+#define MESHCHAT_RELIABLE 1         // 0 stops advertising/using it
+#define MESHCHAT_REL_WINDOW 32      // max unacked packets per peer
+#define MESHCHAT_REL_BACKLOG 128    // packets waiting for window space
+#define MESHCHAT_REL_MAX_TRIES 8
+#define MESHCHAT_REL_RTO_INIT 1000
+#define MESHCHAT_REL_RTO_MIN 200
+#define MESHCHAT_REL_RTO_MAX 10000
+#define MESHCHAT_REL_TICK 50
+
+// pacing: token buckets per peer and for all egress. rates are datagrams
+// per second, bursts are datagrams
+#define MESHCHAT_PACE_PEER_RATE 200
+#define MESHCHAT_PACE_PEER_BURST MESHCHAT_REL_WINDOW
+#define MESHCHAT_PACE_RATE 4000
+#define MESHCHAT_PACE_BURST 256
+#define MESHCHAT_PACE_QUEUE 512     // max datagrams waiting per peer
+#define MESHCHAT_PACE_TICK 10       // ms
+
+// coalescing: events for a peer are held this long (ms) to be sent
+// together in one datagram
+#define MESHCHAT_COALESCE 1
+#define MESHCHAT_COALESCE_DELAY 20
+
+// fragmentation: events too big for one datagram are split into numbered
+// fragments: type, message id, index, count, data
+#define MESHCHAT_FRAG 1
+#define MESHCHAT_FRAG_HDR 7
+#define MESHCHAT_FRAG_DATA (MESHCHAT_PAYLOAD_LEN - MESHCHAT_FRAG_HDR)
+#define MESHCHAT_FRAG_MAX 16        // fragments per event
+#define MESHCHAT_EVENT_MAX (MESHCHAT_FRAG_MAX * MESHCHAT_FRAG_DATA)
+#define MESHCHAT_FRAG_SLOTS 16      // events being reassembled at once
+#define MESHCHAT_FRAG_PER_PEER 4
+#define MESHCHAT_FRAG_MEMORY (256 * 1024)
+#define MESHCHAT_FRAG_TIMEOUT 5000  // ms
+
+// accept and send events in the format from before wire.h, for peers that
+// don't advertise it yet
+#define MESHCHAT_WIRE_LEGACY 1
+
+// greeting flag: the channel list is left out, as it hasn't changed from
+// the one the digest field describes
+#define GREETING_NO_CHANNELS 0x01
+
+#if defined(__linux__)
+#define MESHCHAT_HAVE_SENDMMSG
+#define MESHCHAT_HAVE_RECVMMSG
+#endif
+
+// fixed-size objects recycled through a free list, grown a slab at a time.
+// slabs are only released by pool_free
+struct pool_slab {
+    struct pool_slab *next;
+};
+
+struct pool {
+    void *free; // free list, linked through the first word of each object
+    struct pool_slab *slabs;
+    size_t size;
+    size_t capacity;
+    size_t in_use;
+    size_t high_water;
+};
+
+// an encoded datagram, shared by every send of it and never modified
+// after encoding. released when the last reference is dropped
+struct packet {
+    unsigned int refs;
+    size_t len;
+    char data[MESHCHAT_PACKETLEN];
+};
+
+// datagrams collected for one flush to the socket
+struct send_batch {
+    size_t n;
+    peer_t *peers[MESHCHAT_SEND_BATCH];
+    struct packet *packets[MESHCHAT_SEND_BATCH]; // NULL for header-only
+    size_t hdr_len[MESHCHAT_SEND_BATCH];
+    char hdr[MESHCHAT_SEND_BATCH][MESHCHAT_HDR_MAX];
+    struct iovec iov[MESHCHAT_SEND_BATCH][2];
+#ifdef MESHCHAT_HAVE_SENDMMSG
+    struct mmsghdr msgs[MESHCHAT_SEND_BATCH];
+#endif
+};
+
+// one received datagram. data is kept NUL-terminated past len
+struct recv_slot {
+    struct sockaddr_in6 addr;
+    size_t len;
+    char data[MESHCHAT_PACKETLEN + 1];
+};
+
+// preallocated slots drained on each socket wakeup
+struct recv_ring {
+    struct recv_slot slots[MESHCHAT_RECV_BATCH];
+#ifdef MESHCHAT_HAVE_RECVMMSG
+    struct iovec iov[MESHCHAT_RECV_BATCH];
+    struct mmsghdr msgs[MESHCHAT_RECV_BATCH];
+#endif
+};
+
+// an event being reassembled from fragments. free while data is NULL
+struct frag_entry {
+    peer_t *peer;
+    uint32_t id;
+    unsigned int count;
+    unsigned int received;
+    uint32_t have;          // bit per fragment received
+    size_t len;             // known once the last fragment is in
+    size_t size;
+    uint64_t started;
+    char *data;
+};
+
+// peers known to be in a channel, keyed by name in meshchat_t
+struct channel {
+    char *name;
+    peer_t **members;
+    size_t n;
+    size_t capacity;
+    unsigned int mark;      // last full greeting that listed it
+};
+
+// an event encoded in one wire format, built when a peer first needs it
+struct outgoing {
+    const struct event *ev;
+    int legacy;
+    int built;
+    struct packet *pkt;     // the whole event, if it fits in one datagram
+    struct packet *frags[MESHCHAT_FRAG_MAX]; // otherwise, in fragments
+    size_t n;
+    struct packet *trunc;   // and cut short, for peers without frag
+};
+
+// pooled send request, holding a reference to its packet until sent.
+// also queues datagrams held back by pacing
+struct send_req {
+    uv_udp_send_t req;
+    struct packet *packet;
+    size_t hdr_len;
+    char hdr[MESHCHAT_HDR_MAX];
+    uint64_t queued_at;
+    struct send_req *next;
+};
+
+// a packet sent reliably and not yet acknowledged
+struct rel_slot {
+    struct packet *pkt; // NULL once acked or given up on
+    uint64_t sent_at;
+    unsigned int tries;
+    int queued;         // held back by pacing, not sent yet
+};
+
+// per-peer reliability state, allocated once a peer uses the layer.
+// sequence numbers are counted per sending epoch, which changes whenever
+// a node restarts
+struct rel_state {
+    peer_t *peer;
+    // sending side
+    uint32_t next_seq;  // sequence number of the next new packet
+    uint32_t una;       // oldest unacknowledged sequence number
+    struct rel_slot tx[MESHCHAT_REL_WINDOW];
+    struct packet *backlog[MESHCHAT_REL_BACKLOG];
+    size_t backlog_head;
+    size_t backlog_len;
+    int rtt_valid;
+    double srtt;
+    double rttvar;
+    unsigned int rto;
+    unsigned int dupacks;
+    // receiving side
+    uint32_t rx_epoch;
+    uint32_t rx_next;   // next sequence number to deliver
+    struct packet *rx[MESHCHAT_REL_WINDOW]; // received out of order
+    int ack_pending;
+    // list of peers with packets in flight
+    int inflight;
+    struct rel_state *inflight_prev;
+    struct rel_state *inflight_next;
+};
+
+// counters, dumped on SIGUSR1
+struct meshchat_stats {
+    unsigned long batches;      // flushes that reached the socket
+    unsigned long batch_syscalls;
+    unsigned long batch_sent;   // datagrams sent in batches
+    unsigned long batch_last;   // datagrams sent in the last batch
+    unsigned long batch_max;
+    unsigned long send_queued;  // datagrams handed to uv_udp_send
+    unsigned long send_errors;
+    unsigned long recv_batches; // socket wakeups with data
+    unsigned long recv_syscalls;
+    unsigned long recv_datagrams;
+    unsigned long recv_max;
+    unsigned long recv_dropped; // oversized or unreadable datagrams
+    unsigned long rel_sent;
+    unsigned long rel_retransmits;
+    unsigned long rel_fast_retransmits;
+    unsigned long rel_expired;  // given up after MESHCHAT_REL_MAX_TRIES
+    unsigned long rel_backlog_drops;
+    unsigned long rel_acks_sent;
+    unsigned long rel_acks_recv;
+    unsigned long rel_delivered;
+    unsigned long rel_duplicates;
+    unsigned long rel_out_of_order;
+    unsigned long pace_immediate; // datagrams that had tokens right away
+    unsigned long pace_queued;
+    unsigned long pace_dropped;
+    unsigned long pace_depth;     // datagrams waiting now
+    unsigned long pace_depth_max;
+    uint64_t pace_delay_total;    // ms spent waiting, over all datagrams
+    uint64_t pace_delay_max;
+    unsigned long coalesce_events;  // events put in bundles
+    unsigned long coalesce_sent;    // datagrams those went out in
+    unsigned long coalesce_full;    // flushed because the next didn't fit
+    unsigned long coalesce_dropped;
+    unsigned long frag_events;      // events we split
+    unsigned long frag_sent;        // fragments those made
+    unsigned long frag_truncated;   // sent cut short to peers without frag
+    unsigned long frag_reassembled;
+    unsigned long frag_expired;
+    unsigned long frag_evicted;     // dropped to make room
+    size_t frag_mem_max;
+    unsigned long wire_events;      // received in the versioned format
+    unsigned long wire_legacy;      // and in the old one
+    unsigned long wire_malformed;
+    unsigned long greet_full;       // greetings sent with our channels
+    unsigned long greet_delta;      // and without
+    unsigned long greet_unchanged;  // received without, as we had them
+    unsigned long greet_requests;   // received without, but we didn't
+    unsigned long wheel_ticks;
+    unsigned long wheel_fired;      // peer deadlines that came due
+    unsigned long wheel_fired_max;  // most in one tick
+    unsigned long evicted_aged;     // peers dropped for being long gone
+    unsigned long evicted_full;     // to make room for new ones
+    unsigned long peers_refused;    // new peers not added, as none could go
+    unsigned long greet_deferred;   // scheduled greetings put off a tick
+    unsigned long direct_sent;      // private messages sent to one peer
+    unsigned long direct_unknown;   // to nicks we don't know
+    unsigned long chan_events;      // events sent to channel members only
+    unsigned long chan_sent;        // peers those went to
+    uint64_t greet_sum;             // greetings over ticks that had any
+    uint64_t greet_sum_sq;
+    unsigned long greet_tick_max;
+};
+
+// peers by the binary form of their address
+KHASH_INIT(peer, struct in6_addr, peer_id_t, 1, in6_hash, in6_equal)
 
 struct meshchat {
     ircd_t *ircd;
@@ -38,57 +317,177 @@ struct meshchat {
     //const char *host;
     int port;
     uv_udp_t handle;
-    void* buffer;
+    struct recv_ring *ring;
+    int recv_drain;         // drain the socket after libuv's datagram
+    size_t recv_wakeup;     // datagrams read since the socket was empty
     char ip[INET6_ADDRSTRLEN];
     struct timespec last_peerfetch;
-    struct timespec last_peerservice;
-    hash_t *peers;
+    khash_t(peer) *peers;   // address -> id in store
+    struct peerstore store;
+    hash_t *channel_index;  // channel name -> struct channel
+    hash_t *nick_index;     // nick -> peer_t
+    size_t memberships;
+    unsigned int chan_mark; // for finding channels a greeting left out
     char nick[MESHCHAT_NAME_LEN]; // our node's nick
     struct peer *me;
+    struct timerwheel wheel;    // peer deadlines, in ticks of loop time
+    uv_timer_t wheel_timer;
+    uint64_t random;        // xorshift state
+    uint64_t greet_start;   // tick we started counting greetings
+    uint64_t greet_tick;
+    unsigned long greet_tick_n;  // greetings sent in greet_tick
+    char channels[MESHCHAT_EVENT_MAX]; // ours, as sent in greetings
+    size_t channels_len;
+    uint64_t digest;        // of our channels
+    int channels_dirty;
+    struct send_batch batch;
+    struct pool send_pool;
+    struct pool packet_pool;
+    struct meshchat_stats stats;
+    uv_signal_t stats_signal;
+    unsigned int caps;      // capabilities we advertise
+    uint32_t epoch;         // identifies our reliable streams since startup
+    struct rel_state *rel_inflight;
+    uv_timer_t rel_timer;
+    peer_t *acks[MESHCHAT_RECV_BATCH]; // peers owed an ack
+    size_t acks_n;
+    double egress_tokens;
+    uint64_t egress_refill;
+    peer_t *paced_head;     // peers with datagrams waiting, round robin
+    peer_t *paced_tail;
+    size_t paced_len;
+    uv_timer_t pace_timer;
+    peer_t *coalescing;     // peers with events waiting to be bundled
+    uv_timer_t coalesce_timer;
+    uint32_t frag_id;
+    struct frag_entry frags[MESHCHAT_FRAG_SLOTS];
+    size_t frag_mem;        // bytes held by the reassembly table
+};
+
+enum peer_caps {
+    PEER_CAP_RELIABLE = 1 << 0,
+    PEER_CAP_BUNDLE = 1 << 1,
+    PEER_CAP_FRAG = 1 << 2,
+    PEER_CAP_WIRE = 1 << 3,
 };
 
+// capability names, listed in greetings after the channels
+static const struct {
+    const char *name;
+    unsigned int cap;
+} capabilities[] = {
+    {"rel", PEER_CAP_RELIABLE},
+    {"bundle", PEER_CAP_BUNDLE},
+    {"frag", PEER_CAP_FRAG},
+    {"v2", PEER_CAP_WIRE},
+};
+
+// a peer's state other than the hot fields in meshchat_t's store
 struct peer {
-    char ip[40];
+    peer_id_t id;
+    char ip[INET6_ADDRSTRLEN];       // empty until peer_ip needs it
     struct sockaddr_in6 addr;
-    enum peer_status status;
-    struct timespec last_message;    // they sent to us
-    struct timespec last_greeted;    // we sent to them
+    uint64_t last_greeted;           // we sent to them
+    int listed;                      // in the cjdns routing table
+    struct timerwheel_timer timer;   // next greet, timeout or retry
     char *nick;
-};
-
-enum event_type {
-    EVENT_GREETING = 1,
-    EVENT_MSG,
-    EVENT_NOTICE,
-    EVENT_JOIN,
-    EVENT_PART,
-    EVENT_NICK,
+    peer_t *nick_next;               // next peer with the same nick
+    unsigned int caps;               // capabilities we share with them
+    struct rel_state *rel;
+    // pacing
+    double tokens;
+    uint64_t refill;
+    struct send_req *queue_head;
+    struct send_req *queue_tail;
+    size_t queue_len;
+    size_t queue_max;
+    unsigned long pace_dropped;
+    uint64_t pace_delay_max;
+    int paced;
+    peer_t *paced_next;
+    // coalescing
+    struct packet *bundle;           // events waiting to go out together
+    unsigned int bundle_n;
+    int coalescing;
+    peer_t *coalesce_next;
+    // greetings
+    uint64_t digest;                 // of their channels, as last listed
+    uint64_t sent_digest;            // of ours, as last listed to them
+    struct channel **chans;          // channels they are in
+    size_t chans_n;
+    size_t chans_capacity;
 };
 
 const char *event_names[] = {
     NULL,
     "greeting",
     "msg",
-    "action",
     "notice",
     "join",
     "part",
-    "nick"
+    "nick",
+    "data",
+    "ack",
+    "bundle",
+    "frag",
+    "greeting_req"
 };
 
 static void
-handle_datagram(uv_udp_t* handle,
+on_recv(uv_udp_t* handle,
         ssize_t nread,
         const uv_buf_t* buf,
         const struct sockaddr* in,
         unsigned flags);
+static void handle_datagram(meshchat_t *mc, const struct sockaddr_in6 *addr,
+        const char *msg, size_t len);
+static void handle_event(meshchat_t *mc, peer_t *peer,
+        const char *msg, size_t len);
 
 peer_t *get_peer(meshchat_t *mc, const char *ip);
-static void found_ip(void *obj, const char *ip);
+static peer_t *peer_lookup(meshchat_t *mc, const struct in6_addr *addr);
+static const char *peer_ip(peer_t *peer);
+static void found_ip(void *obj, const struct in6_addr *ip);
+static void lost_ip(void *obj, const struct in6_addr *ip);
 static void service_peers(uv_timer_t *timer);
-peer_t *peer_new(const char *ip);
-void peer_send(meshchat_t *mc, peer_t *peer, char *msg, size_t len);
+static void peer_schedule(meshchat_t *mc, peer_t *peer);
+static int peers_make_room(meshchat_t *mc);
+static int peer_stale(meshchat_t *mc, peer_t *peer, uint64_t now);
+static void peer_evict(meshchat_t *mc, peer_t *peer);
+static struct channel *channel_join(meshchat_t *mc, peer_t *peer,
+        const char *name);
+static void channel_remove(meshchat_t *mc, struct channel *chan,
+        peer_t *peer);
+static uint64_t channels_digest(const char *p, const char *end);
+static void channel_part(meshchat_t *mc, peer_t *peer, const char *name);
+static void channel_part_all(meshchat_t *mc, peer_t *peer);
+static uint32_t mc_random(meshchat_t *mc);
+static unsigned long greet_tick_count(meshchat_t *mc);
+peer_t *peer_new(const struct in6_addr *addr);
+void peer_send(meshchat_t *mc, peer_t *peer, const char *hdr, size_t hdr_len,
+        struct packet *pkt);
+static void batch_add(meshchat_t *mc, peer_t *peer, const char *hdr,
+        size_t hdr_len, struct packet *pkt);
+static void batch_flush(meshchat_t *mc);
+static void peer_transmit(meshchat_t *mc, peer_t *peer, struct packet *pkt);
+static int pace_send(meshchat_t *mc, peer_t *peer, const char *hdr,
+        size_t hdr_len, struct packet *pkt);
+static void pace_reset(meshchat_t *mc, peer_t *peer);
+static void pace_tick(uv_timer_t *timer);
+static void rel_reset(meshchat_t *mc, peer_t *peer);
+static void bundle_recv(meshchat_t *mc, peer_t *peer, const char *msg,
+        size_t len);
+static void coalesce_reset(meshchat_t *mc, peer_t *peer);
+static void frag_recv(meshchat_t *mc, peer_t *peer, const char *msg,
+        size_t len);
+static void rel_recv_data(meshchat_t *mc, peer_t *peer,
+        const char *msg, size_t len);
+static void rel_recv_ack(meshchat_t *mc, peer_t *peer,
+        const char *msg, size_t len);
+static void rel_ack_flush(meshchat_t *mc);
+static void rel_tick(uv_timer_t *timer);
 void greet_peer(meshchat_t *mc, peer_t *peer);
+static void greet_request(meshchat_t *mc, peer_t *peer);
 
 void on_irc_msg(void *obj, char *channel, char *data);
 void on_irc_notice(void *obj, char *channel, char *data);
@@ -96,6 +495,140 @@ void on_irc_nick(void *obj, char *channel, char *data);
 void on_irc_join(void *obj, char *channel, char *data);
 void on_irc_part(void *obj, char *channel, char *data);
 
+static inline void
+put_u16(char *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static inline uint16_t
+get_u16(const char *p) {
+    const unsigned char *u = (const unsigned char *)p;
+    return (uint16_t)(u[0] << 8 | u[1]);
+}
+
+static inline void
+put_u32(char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static inline uint32_t
+get_u32(const char *p) {
+    const unsigned char *u = (const unsigned char *)p;
+    return (uint32_t)u[0] << 24 | (uint32_t)u[1] << 16 |
+        (uint32_t)u[2] << 8 | u[3];
+}
+
+static inline void
+put_u64(char *p, uint64_t v) {
+    put_u32(p, v >> 32);
+    put_u32(p + 4, v);
+}
+
+static inline uint64_t
+get_u64(const char *p) {
+    return (uint64_t)get_u32(p) << 32 | get_u32(p + 4);
+}
+
+static void
+pool_init(struct pool *pool, size_t size) {
+    memset(pool, 0, sizeof(*pool));
+    // keep objects aligned for any member type
+    pool->size = (size + 15) & ~(size_t)15;
+}
+
+static void *
+pool_get(struct pool *pool) {
+    void *obj;
+    size_t i;
+
+    if (!pool->free) {
+        // grow the pool by a slab
+        struct pool_slab *slab = malloc(sizeof(struct pool_slab) + 16 +
+                pool->size * MESHCHAT_POOL_SLAB);
+        if (!slab) {
+            perror("malloc");
+            return NULL;
+        }
+        char *objs = (char *)slab + ((sizeof(*slab) + 15) & ~(size_t)15);
+        for (i = 0; i < MESHCHAT_POOL_SLAB; i++) {
+            obj = objs + i * pool->size;
+            *(void **)obj = pool->free;
+            pool->free = obj;
+        }
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        pool->capacity += MESHCHAT_POOL_SLAB;
+    }
+
+    obj = pool->free;
+    pool->free = *(void **)obj;
+    pool->in_use++;
+    if (pool->in_use > pool->high_water) {
+        pool->high_water = pool->in_use;
+    }
+    return obj;
+}
+
+static void
+pool_put(struct pool *pool, void *obj) {
+    *(void **)obj = pool->free;
+    pool->free = obj;
+    pool->in_use--;
+}
+
+static void
+pool_free(struct pool *pool) {
+    struct pool_slab *slab, *next;
+    for (slab = pool->slabs; slab; slab = next) {
+        next = slab->next;
+        free(slab);
+    }
+    pool->slabs = NULL;
+    pool->free = NULL;
+}
+
+// get an empty packet to encode into, holding one reference
+static struct packet *
+packet_new(meshchat_t *mc) {
+    struct packet *pkt = pool_get(&mc->packet_pool);
+    if (!pkt) {
+        return NULL;
+    }
+    pkt->refs = 1;
+    pkt->len = 0;
+    return pkt;
+}
+
+static inline struct packet *
+packet_ref(struct packet *pkt) {
+    pkt->refs++;
+    return pkt;
+}
+
+static void
+packet_unref(meshchat_t *mc, struct packet *pkt) {
+    if (--pkt->refs == 0) {
+        pool_put(&mc->packet_pool, pkt);
+    }
+}
+
+// free what meshchat_new got before failing. each may be null
+static void
+meshchat_new_undo(meshchat_t *mc) {
+    if (mc->cjdnsadmin) {
+        cjdnsadmin_free(mc->cjdnsadmin);
+    }
+    kh_destroy(peer, mc->peers);
+    hash_free(mc->channel_index);
+    hash_free(mc->nick_index);
+    free(mc->ring);
+    free(mc);
+}
+
 meshchat_t *meshchat_new() {
     meshchat_t *mc = calloc(1, sizeof(meshchat_t));
     if (!mc) {
@@ -103,22 +636,32 @@ meshchat_t *meshchat_new() {
         return NULL;
     }
 
-    mc->peers = hash_new();
-    if (!mc->peers) {
-        free(mc);
+    mc->peers = kh_init(peer);
+    mc->channel_index = hash_new();
+    mc->nick_index = hash_new();
+    mc->ring = calloc(1, sizeof(struct recv_ring));
+    if (!mc->peers || !mc->channel_index || !mc->nick_index || !mc->ring) {
+        perror("calloc");
+        meshchat_new_undo(mc);
         return NULL;
     }
+    peerstore_init(&mc->store);
+    timerwheel_init(&mc->wheel,
+            uv_now(uv_default_loop()) / MESHCHAT_WHEEL_TICK);
+
+    pool_init(&mc->send_pool, sizeof(struct send_req));
+    pool_init(&mc->packet_pool, sizeof(struct packet));
 
     mc->cjdnsadmin = cjdnsadmin_new();
     if (!mc->cjdnsadmin) {
-        free(mc->peers);
-        free(mc);
+        meshchat_new_undo(mc);
         fprintf(stderr, "fail\n");
         return NULL;
     }
 
     // add callback for peer discovery through cjdns
     cjdnsadmin_on_found_ip(mc->cjdnsadmin, found_ip, (void *)mc);
+    cjdnsadmin_on_lost_ip(mc->cjdnsadmin, lost_ip, (void *)mc);
 
     ircd_callbacks_t callbacks = {
         .on_msg     = {mc, on_irc_msg},
@@ -130,12 +673,32 @@ meshchat_t *meshchat_new() {
 
     mc->ircd = ircd_new(&callbacks);
     if (!mc->ircd) {
+        meshchat_new_undo(mc);
         fprintf(stderr, "fail\n");
-        exit(1);
+        return NULL;
     }
 
     // todo: allow custom port/hostname
     mc->port = MESHCHAT_PORT;
+
+    if (MESHCHAT_RELIABLE) {
+        mc->caps |= PEER_CAP_RELIABLE;
+    }
+    if (MESHCHAT_COALESCE) {
+        mc->caps |= PEER_CAP_BUNDLE;
+    }
+    if (MESHCHAT_FRAG) {
+        mc->caps |= PEER_CAP_FRAG;
+    }
+    mc->caps |= PEER_CAP_WIRE;
+    mc->channels_dirty = 1;
+    mc->egress_tokens = MESHCHAT_PACE_BURST;
+    mc->epoch = (uint32_t)(uv_hrtime() ^ ((uint64_t)getpid() << 16));
+    if (!mc->epoch) {
+        mc->epoch = 1;
+    }
+    mc->random = uv_hrtime() | 1;
+    mc->greet_start = mc->greet_tick = mc->wheel.now;
     //mc->host = "::"; // wildcard
 
     return mc;
@@ -143,9 +706,15 @@ meshchat_t *meshchat_new() {
 
 void
 meshchat_free(meshchat_t *mc) {
+    pool_free(&mc->send_pool);
+    pool_free(&mc->packet_pool);
     cjdnsadmin_free(mc->cjdnsadmin);
     ircd_free(mc->ircd);
-    hash_free(mc->peers);
+    kh_destroy(peer, mc->peers);
+    peerstore_free(&mc->store);
+    hash_free(mc->channel_index);
+    hash_free(mc->nick_index);
+    free(mc->ring);
     free(mc);
 }
 
@@ -153,10 +722,96 @@ static void fetch_peers(uv_timer_t* timer) {
     cjdnsadmin_fetch_peers((cjdnsadmin_t*)timer->data);
 }
 
+static void
+print_stats(uv_signal_t *handle, int signum) {
+    meshchat_t *mc = handle->data;
+    struct meshchat_stats *st = &mc->stats;
+    printf("peers: %zu (ids: %u, %zu free), evicted: %lu aged, %lu full, "
+            "refused: %lu\n", mc->store.count, mc->store.size,
+            mc->store.free_n, st->evicted_aged, st->evicted_full,
+            st->peers_refused);
+    printf("send batches: %lu (%lu syscalls), datagrams: %lu, "
+            "last: %lu, max: %lu, avg: %.1f\n",
+            st->batches, st->batch_syscalls, st->batch_sent,
+            st->batch_last, st->batch_max,
+            st->batches ? (double)st->batch_sent / st->batches : 0.0);
+    printf("send queued: %lu, errors: %lu\n",
+            st->send_queued, st->send_errors);
+    printf("send pool: %zu/%zu in use, high water: %zu\n",
+            mc->send_pool.in_use, mc->send_pool.capacity,
+            mc->send_pool.high_water);
+    printf("packet pool: %zu/%zu in use, high water: %zu\n",
+            mc->packet_pool.in_use, mc->packet_pool.capacity,
+            mc->packet_pool.high_water);
+    printf("reliable sent: %lu, retransmits: %lu (%lu fast), expired: %lu, "
+            "backlog drops: %lu\n",
+            st->rel_sent, st->rel_retransmits, st->rel_fast_retransmits,
+            st->rel_expired, st->rel_backlog_drops);
+    printf("reliable delivered: %lu, duplicates: %lu, out of order: %lu, "
+            "acks sent: %lu, recv: %lu\n",
+            st->rel_delivered, st->rel_duplicates, st->rel_out_of_order,
+            st->rel_acks_sent, st->rel_acks_recv);
+    printf("paced: %lu immediate, %lu queued, %lu dropped, depth: %lu "
+            "(max %lu), delay avg: %.1f ms, max: %llu ms\n",
+            st->pace_immediate, st->pace_queued, st->pace_dropped,
+            st->pace_depth, st->pace_depth_max,
+            st->pace_queued ? (double)st->pace_delay_total / st->pace_queued
+                : 0.0,
+            (unsigned long long)st->pace_delay_max);
+    printf("fragmented: %lu events into %lu fragments, %lu truncated, "
+            "reassembled: %lu, expired: %lu, evicted: %lu, "
+            "memory: %zu (max %zu)\n", st->frag_events, st->frag_sent,
+            st->frag_truncated, st->frag_reassembled, st->frag_expired,
+            st->frag_evicted, mc->frag_mem, st->frag_mem_max);
+    printf("received events: %lu versioned, %lu legacy, %lu malformed\n",
+            st->wire_events, st->wire_legacy, st->wire_malformed);
+    printf("greetings: %lu full, %lu delta, received unchanged: %lu, "
+            "requested: %lu\n", st->greet_full, st->greet_delta,
+            st->greet_unchanged, st->greet_requests);
+    printf("peer deadlines: %zu scheduled, %lu ticks, %lu fired "
+            "(max %lu in one service)\n", mc->wheel.count, st->wheel_ticks,
+            st->wheel_fired, st->wheel_fired_max);
+    uint64_t ticks = uv_now(uv_default_loop()) / MESHCHAT_WHEEL_TICK -
+        mc->greet_start;
+    greet_tick_count(mc);
+    if (ticks) {
+        double mean = (double)st->greet_sum / ticks;
+        printf("greetings per tick: mean %.2f, max %lu (%.1fx mean), "
+                "variance %.2f, deferred: %lu\n", mean, st->greet_tick_max,
+                mean > 0 ? st->greet_tick_max / mean : 0.0,
+                (double)st->greet_sum_sq / ticks - mean * mean,
+                st->greet_deferred);
+    }
+    printf("private messages: %lu sent, %lu to unknown nicks, "
+            "%u nicks known\n",
+            st->direct_sent, st->direct_unknown, hash_size(mc->nick_index));
+    printf("channels: %u with members, %zu memberships, "
+            "%lu channel events sent to %lu peers\n",
+            hash_size(mc->channel_index), mc->memberships,
+            st->chan_events, st->chan_sent);
+    printf("coalesced: %lu events into %lu datagrams (%lu full), "
+            "%lu dropped\n", st->coalesce_events, st->coalesce_sent,
+            st->coalesce_full, st->coalesce_dropped);
+    peerstore_each(&mc->store, {
+        peer_t *peer = peerstore_get(&mc->store, id);
+        if (peer->queue_max) {
+            printf("  %s: queue %zu (max %zu), dropped %lu, "
+                    "max delay %llu ms\n", peer_ip(peer), peer->queue_len,
+                    peer->queue_max, peer->pace_dropped,
+                    (unsigned long long)peer->pace_delay_max);
+        }
+    });
+    printf("recv wakeups: %lu (%lu syscalls), datagrams: %lu, max: %lu, "
+            "dropped: %lu\n",
+            st->recv_batches, st->recv_syscalls, st->recv_datagrams,
+            st->recv_max, st->recv_dropped);
+}
+
+// libuv reads the first datagram of a wakeup into the first ring slot
 void alloc_cb(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
     meshchat_t* mc = (meshchat_t*)handle->data;
-    buf->base = mc->buffer = realloc(mc->buffer,suggested_size);
-    buf->len = suggested_size;
+    buf->base = mc->ring->slots[0].data;
+    buf->len = MESHCHAT_PACKETLEN;
 }
 
 void
@@ -223,327 +878,2356 @@ meshchat_start(meshchat_t *mc) {
 
     // never stopping the timer, so forget about freeing it.
 
-    timer = malloc(sizeof(uv_timer_t));
-    timer->data = mc;
-    uv_timer_init(uv_default_loop(),timer);
-    uv_timer_start(timer,service_peers,
-            0 , 1000 * MESHCHAT_PEERSERVICE_INTERVAL);
+    mc->wheel_timer.data = mc;
+    uv_timer_init(uv_default_loop(), &mc->wheel_timer);
+    uv_timer_start(&mc->wheel_timer, service_peers,
+            MESHCHAT_WHEEL_TICK, MESHCHAT_WHEEL_TICK);
 
     mc->handle.data = mc;
 
-    uv_udp_recv_start(&mc->handle, alloc_cb, handle_datagram);
-    // handle_datagram(mc, (struct sockaddr *)&src_addr, buffer, count);
+    // retransmission timer, running while packets are in flight
+    mc->rel_timer.data = mc;
+    uv_timer_init(uv_default_loop(), &mc->rel_timer);
+
+    // pacing timer, running while datagrams are held back
+    mc->pace_timer.data = mc;
+    uv_timer_init(uv_default_loop(), &mc->pace_timer);
+
+    // coalescing timer, started when a peer's first event is held
+    mc->coalesce_timer.data = mc;
+    uv_timer_init(uv_default_loop(), &mc->coalesce_timer);
+
+    // dump counters on SIGUSR1
+    mc->stats_signal.data = mc;
+    uv_signal_init(uv_default_loop(), &mc->stats_signal);
+    uv_signal_start(&mc->stats_signal, print_stats, SIGUSR1);
+
+    uv_udp_recv_start(&mc->handle, alloc_cb, on_recv);
+}
+
+// drain whatever else is waiting on the socket into the rest of the ring.
+// returns the number of slots filled after the first one
+static size_t
+recv_drain(meshchat_t *mc) {
+    size_t n = 0;
+#ifdef MESHCHAT_HAVE_RECVMMSG
+    struct recv_ring *ring = mc->ring;
+    uv_os_fd_t fd;
+    size_t i;
+    int rc;
+
+    if (MESHCHAT_RECV_BATCH < 2 ||
+            uv_fileno((uv_handle_t *)&mc->handle, &fd) < 0) {
+        return 0;
+    }
+    for (i = 1; i < MESHCHAT_RECV_BATCH; i++) {
+        struct msghdr *hdr = &ring->msgs[i].msg_hdr;
+        memset(hdr, 0, sizeof(*hdr));
+        ring->iov[i].iov_base = ring->slots[i].data;
+        ring->iov[i].iov_len = MESHCHAT_PACKETLEN;
+        hdr->msg_name = &ring->slots[i].addr;
+        hdr->msg_namelen = sizeof(ring->slots[i].addr);
+        hdr->msg_iov = &ring->iov[i];
+        hdr->msg_iovlen = 1;
+    }
+    do {
+        rc = recvmmsg(fd, ring->msgs + 1, MESHCHAT_RECV_BATCH - 1,
+                MSG_DONTWAIT, NULL);
+    } while (rc < 0 && errno == EINTR);
+    mc->stats.recv_syscalls++;
+    if (rc < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("recvmmsg");
+        }
+        return 0;
+    }
+    for (i = 1; i <= (size_t)rc; i++) {
+        struct recv_slot *slot = &ring->slots[i];
+        if (ring->msgs[i].msg_hdr.msg_flags & MSG_TRUNC ||
+                slot->addr.sin6_family != AF_INET6) {
+            // mark the slot empty
+            mc->stats.recv_dropped++;
+            slot->len = 0;
+        } else {
+            slot->len = ring->msgs[i].msg_len;
+        }
+    }
+    n = rc;
+#endif
+    return n;
 }
 
 static void
-handle_datagram(uv_udp_t* handle,
+on_recv(uv_udp_t* handle,
         ssize_t nread,
         const uv_buf_t* buf,
         const struct sockaddr* in,
         unsigned flags) {
 
     meshchat_t *mc = handle->data;
-    peer_t *peer;
+    struct recv_ring *ring = mc->ring;
+    size_t i, n;
 
+    if (nread < 0) {
+        fprintf(stderr, "recv error: %s\n", uv_strerror(nread));
+        return;
+    }
     if (!in) {
-        // no sender address -> nothing to read
+        // libuv found the socket empty. draining next time only pays off
+        // if this wakeup had more than the one datagram
+        mc->recv_drain = mc->recv_wakeup > 1;
+        mc->recv_wakeup = 0;
         return;
     }
-
-    if (!hash_size(mc->peers)) {
-        // got a message without peers. :(
+    if (nread == 0) {
         return;
     }
-    static char ip[INET6_ADDRSTRLEN];
+    if (flags & UV_UDP_PARTIAL || in->sa_family != AF_INET6) {
+        mc->stats.recv_dropped++;
+        ring->slots[0].len = 0;
+    } else {
+        memcpy(&ring->slots[0].addr, in, sizeof(struct sockaddr_in6));
+        ring->slots[0].len = nread;
+    }
 
-    // convert ip to string
-    struct sockaddr_in6 *addr = (struct sockaddr_in6 *)in;
-    if (!inet_ntop(AF_INET6, &(addr->sin6_addr), ip, INET6_ADDRSTRLEN)) {
-        perror("inet_ntop");
+    n = 1;
+    if (mc->recv_drain) {
+        n += recv_drain(mc);
+        if (n < MESHCHAT_RECV_BATCH) {
+            // it came up short so the socket was empty. leave the rest of
+            // this wakeup to libuv rather than asking again
+            mc->recv_drain = 0;
+        }
+    }
+    mc->recv_wakeup += n;
+
+    mc->stats.recv_batches++;
+    mc->stats.recv_datagrams += n;
+    if (n > mc->stats.recv_max) {
+        mc->stats.recv_max = n;
+    }
+
+    for (i = 0; i < n; i++) {
+        struct recv_slot *slot = &ring->slots[i];
+        if (slot->len) {
+            slot->data[slot->len] = '\0';
+            handle_datagram(mc, &slot->addr, slot->data, slot->len);
+        }
+    }
+
+    // acknowledge the whole batch at once
+    rel_ack_flush(mc);
+    batch_flush(mc);
+}
+
+static void
+handle_datagram(meshchat_t *mc, const struct sockaddr_in6 *addr,
+        const char *msg, size_t len) {
+    const struct sockaddr *in = (const struct sockaddr *)addr;
+    struct peerstore *ps = &mc->store;
+    peer_t *peer;
+
+    if (!mc->store.count) {
+        // got a message without peers. :(
         return;
     }
-    peer = get_peer(mc, ip);
+    peer = peer_lookup(mc, &addr->sin6_addr);
     if (!peer) {
         fprintf(stderr, "Unable to handle message from peer %s: \"%s\"\n",
-                sprint_addrport(in), buf->base);
+                sprint_addrport(in), msg);
+        return;
+    }
+
+    handle_event(mc, peer, msg, len);
+    ps->last_message[peer->id] = uv_now(uv_default_loop());
+    if (ps->status[peer->id] != PEER_ACTIVE) {
+        // their deadlines change with their status
+        ps->status[peer->id] = PEER_ACTIVE;
+        if (ps->next_greet[peer->id] >
+                peer->last_greeted + 1000 * MESHCHAT_PING_INTERVAL) {
+            ps->next_greet[peer->id] = peer->last_greeted +
+                1000 * MESHCHAT_PING_INTERVAL;
+        }
+        peer_schedule(mc, peer);
+    }
+}
+
+// look up the capability bits for a capability name
+static unsigned int
+cap_lookup(const char *name) {
+    size_t i;
+    for (i = 0; i < sizeof(capabilities) / sizeof(*capabilities); i++) {
+        if (strcmp(capabilities[i].name, name) == 0) {
+            return capabilities[i].cap;
+        }
+    }
+    return 0;
+}
+
+static void
+peer_set_caps(meshchat_t *mc, peer_t *peer, unsigned int caps) {
+    caps &= mc->caps;
+    if ((peer->caps & PEER_CAP_RELIABLE) && !(caps & PEER_CAP_RELIABLE)) {
+        // they restarted without the reliability layer
+        rel_reset(mc, peer);
+    }
+    if ((peer->caps & PEER_CAP_BUNDLE) && !(caps & PEER_CAP_BUNDLE)) {
+        coalesce_reset(mc, peer);
+    }
+    peer->caps = caps;
+}
+
+// nicks aren't unique on the mesh. the peers with a nick are chained from
+// its entry in the nick index, and the first of them owns it: the key is
+// the owner's nick buffer, which lives as long as the entry is theirs
+
+// give a nick's entry to an active peer with the nick, if the owner isn't
+static void
+nick_hand_on(meshchat_t *mc, khiter_t k) {
+    peer_t *owner = kh_value(mc->nick_index, k), *prev, *p;
+    if (mc->store.status[owner->id] == PEER_ACTIVE) {
+        return;
+    }
+    for (prev = owner; (p = prev->nick_next); prev = p) {
+        if (mc->store.status[p->id] == PEER_ACTIVE) {
+            prev->nick_next = p->nick_next;
+            p->nick_next = owner;
+            kh_key(mc->nick_index, k) = p->nick;
+            kh_value(mc->nick_index, k) = p;
+            return;
+        }
+    }
+}
+
+// make a peer the owner of their nick's entry, adding it if it is missing
+static void
+peer_claim_nick(meshchat_t *mc, peer_t *peer) {
+    peer_t *owner, *p;
+    khiter_t k;
+    int ret;
+    k = kh_put(ptr, mc->nick_index, peer->nick, &ret);
+    if (ret < 0) {
+        perror("kh_put");
+        return;
+    }
+    owner = ret ? NULL : kh_value(mc->nick_index, k);
+    if (owner == peer) {
         return;
     }
+    // take them out of the chain, if they are in it, and put them first
+    for (p = owner; p && p->nick_next != peer; p = p->nick_next) {
+    }
+    if (p) {
+        p->nick_next = peer->nick_next;
+    }
+    peer->nick_next = owner;
+    kh_key(mc->nick_index, k) = peer->nick;
+    kh_value(mc->nick_index, k) = peer;
+}
+
+// hand a peer's nick on to another active peer with it, if they own it
+static void
+peer_release_nick(meshchat_t *mc, peer_t *peer) {
+    khiter_t k;
+    if (!peer->nick) {
+        return;
+    }
+    k = kh_get(ptr, mc->nick_index, peer->nick);
+    if (k != kh_end(mc->nick_index) && kh_value(mc->nick_index, k) == peer) {
+        nick_hand_on(mc, k);
+    }
+}
+
+// drop a peer's nick, taking them out of its chain in the nick index
+static void
+peer_clear_nick(meshchat_t *mc, peer_t *peer) {
+    peer_t *owner, *p;
+    khiter_t k;
+    if (!peer->nick) {
+        return;
+    }
+    k = kh_get(ptr, mc->nick_index, peer->nick);
+    if (k != kh_end(mc->nick_index)) {
+        owner = kh_value(mc->nick_index, k);
+        if (owner != peer) {
+            for (p = owner; p && p->nick_next != peer; p = p->nick_next) {
+            }
+            if (p) {
+                p->nick_next = peer->nick_next;
+            }
+        } else if (peer->nick_next) {
+            kh_key(mc->nick_index, k) = peer->nick_next->nick;
+            kh_value(mc->nick_index, k) = peer->nick_next;
+            nick_hand_on(mc, k);
+        } else {
+            kh_del(ptr, mc->nick_index, k);
+        }
+    }
+    peer->nick_next = NULL;
+    free(peer->nick);
+    peer->nick = NULL;
+}
 
-    const char *channel;
-    if (peer->status != PEER_ACTIVE) {
-        //printf("Peer woke up: %s\n", peer->ip);
-        // TODO: add the peer back to their channels
+// change a peer's nick, keeping the nick index pointing at them
+static int
+peer_set_nick(meshchat_t *mc, peer_t *peer, const char *nick, size_t len) {
+    char *new_nick = strndup(nick, len);
+    if (!new_nick) {
+        perror("Unable to update nick. strndup");
+        return -1;
     }
-    peer->status = PEER_ACTIVE;
-    current_clock(&peer->last_message);
-    // first byte is the event type
-    //msg[len--] = '\0';
+    peer_clear_nick(mc, peer);
+    peer->nick = new_nick;
+    // the last peer to claim a nick gets it
+    peer_claim_nick(mc, peer);
+    return 0;
+}
+
+// handle an event from a peer. msg must be NUL-terminated after len bytes
+static void
+handle_event(meshchat_t *mc, peer_t *peer, const char *msg, size_t len) {
+    const struct sockaddr *in = (const struct sockaddr *)&peer->addr;
+    const char *channel, *text, *item, *p, *end;
+    struct event ev;
     struct irc_prefix prefix = {
         .nick = peer->nick,
         .user = NULL,
-        .host = peer->ip
+        .host = peer_ip(peer)
     };
-    const char* msg = buf->base;
-    switch(*(msg++)) {
+
+    // first byte is the event type, or the mark of a versioned event
+    switch ((unsigned char)msg[0]) {
+        case EVENT_DATA:
+            rel_recv_data(mc, peer, msg, len);
+            return;
+        case EVENT_ACK:
+            rel_recv_ack(mc, peer, msg, len);
+            return;
+        case EVENT_BUNDLE:
+            bundle_recv(mc, peer, msg, len);
+            return;
+        case EVENT_FRAG:
+            frag_recv(mc, peer, msg, len);
+            return;
+        case WIRE_MARK:
+            if (wire_decode(&ev, msg, len) < 0) {
+                mc->stats.wire_malformed++;
+                return;
+            }
+            mc->stats.wire_events++;
+            break;
+        default:
+            if (!MESHCHAT_WIRE_LEGACY ||
+                    wire_decode_legacy(&ev, msg, len) < 0) {
+                mc->stats.wire_malformed++;
+                return;
+            }
+            mc->stats.wire_legacy++;
+            break;
+    }
+
+    channel = wire_field(&ev, 0);
+    text = wire_field(&ev, 1);
+    switch (ev.type) {
         case EVENT_GREETING:
-            // nick,channel...
+            // nick, channels, capabilities
             //printf("got greeting from %s: \"%s\"\n", sprint_addrport(in), msg);
 
             // note their nick
-            ;
-            size_t nick_len = strlen(msg) + 1;
-            if (!nick_len) break;
-            if (peer->nick) {
-                free(peer->nick);
-            }
-            peer->nick = strndup(msg, nick_len);
-            prefix.nick = peer->nick;
-            if (!peer->nick) {
-                perror("Unable to update nick. strndup");
-                break;
+            if (!ev.n) break;
+            if (!peer->nick || strcmp(peer->nick, ev.field[0]) != 0) {
+                if (peer_set_nick(mc, peer, ev.field[0], ev.len[0]) < 0) {
+                    break;
+                }
+                prefix.nick = peer->nick;
+            } else {
+                // their entry may have been given to another peer with
+                // the nick, or dropped with one that left
+                peer_claim_nick(mc, peer);
             }
 
-            // add that they are in the given channels
-            for (channel = msg + nick_len;
-                    channel - msg < buf->len && channel[0];
-                    channel += strlen(channel) + 1) {
-                ircd_join(mc->ircd, &prefix, channel);
+            uint64_t digest = ev.n > 3 && ev.len[3] == 8 ?
+                get_u64(ev.field[3]) : 0;
+            if (!(ev.flags & GREETING_NO_CHANNELS)) {
+                unsigned int mark = ++mc->chan_mark;
+                size_t i;
+                // add that they are in the given channels
+                p = wire_field(&ev, 1);
+                end = p + (ev.n > 1 ? ev.len[1] : 0);
+                while ((item = wire_list_next(&p, end))) {
+                    if (item[0]) {
+                        struct channel *chan;
+                        ircd_join(mc->ircd, &prefix, item);
+                        chan = channel_join(mc, peer, item);
+                        if (chan) {
+                            chan->mark = mark;
+                        }
+                    }
+                }
+                // and that they left the ones it leaves out, since their
+                // part may have been lost. only when the digest shows the
+                // list is whole, as it is cut short to fit a datagram
+                p = wire_field(&ev, 1);
+                if (digest && digest == channels_digest(p, end)) {
+                    for (i = 0; i < peer->chans_n; ) {
+                        struct channel *chan = peer->chans[i];
+                        if (chan->mark == mark) {
+                            i++;
+                            continue;
+                        }
+                        ircd_part(mc->ircd, &prefix, chan->name, NULL);
+                        peer->chans[i] = peer->chans[--peer->chans_n];
+                        channel_remove(mc, chan, peer);
+                    }
+                }
+                peer->digest = digest;
+            } else if (digest != peer->digest) {
+                // we missed a change to their channels
+                greet_request(mc, peer);
+                mc->stats.greet_requests++;
+            } else {
+                mc->stats.greet_unchanged++;
             }
 
-            // respond back if they are new to us
-            if (peer->status != PEER_ACTIVE ||
-                    time_since(&peer->last_greeted) > MESHCHAT_PING_INTERVAL) {
+            // capabilities. older nodes don't send any
+            unsigned int caps = 0;
+            p = wire_field(&ev, 2);
+            end = p + (ev.n > 2 ? ev.len[2] : 0);
+            while ((item = wire_list_next(&p, end))) {
+                caps |= cap_lookup(item);
+            }
+            unsigned int gained = caps & mc->caps & ~peer->caps;
+            peer_set_caps(mc, peer, caps);
+
+            // respond back if they are new to us, or can now take our
+            // full greeting
+            if (mc->store.status[peer->id] != PEER_ACTIVE ||
+                    uv_now(uv_default_loop()) - peer->last_greeted >
+                        1000 * MESHCHAT_PING_INTERVAL ||
+                    (gained & (PEER_CAP_FRAG | PEER_CAP_WIRE))) {
                 greet_peer(mc, peer);
             }
             break;
         case EVENT_MSG:
             // channel,message
-            channel = msg;
-            msg += strlen(channel)+1;
-            printf("[%s] <%s@%s> \"%s\"\n", channel, prefix.nick, prefix.host, msg);
-            ircd_privmsg(mc->ircd, &prefix, channel, msg);
+            printf("[%s] <%s@%s> \"%s\"\n", channel, prefix.nick, prefix.host, text);
+            ircd_privmsg(mc->ircd, &prefix, channel, text);
             break;
         case EVENT_NOTICE:
-            channel = msg;
-            msg += strlen(channel)+1;
-            printf("[%s] <%s> ! \"%s\"\n", channel, sprint_addrport(in), msg);
-            ircd_notice(mc->ircd, &prefix, channel, msg);
+            printf("[%s] <%s> ! \"%s\"\n", channel, sprint_addrport(in), text);
+            ircd_notice(mc->ircd, &prefix, channel, text);
             break;
         case EVENT_JOIN:
             // channel
-            channel = msg;
             printf("[%s] <%s joined>\n", channel, sprint_addrport(in));
             ircd_join(mc->ircd, &prefix, channel);
+            channel_join(mc, peer, channel);
             break;
         case EVENT_PART:
             // channel
-            channel = msg;
-            msg += strlen(channel)+1;
-            printf("[%s] <%s parted> (%s)\n", channel, sprint_addrport(in), msg);
+            printf("[%s] <%s parted> (%s)\n", channel, sprint_addrport(in), text);
             ircd_part(mc->ircd, &prefix, channel, NULL);
+            channel_part(mc, peer, channel);
             break;
         case EVENT_NICK:
-            ircd_nick(mc->ircd, &prefix, msg);
-            peer->nick = strdup(msg);
-            printf("%s nick: %s\n", sprint_addrport(in), msg);
+            ircd_nick(mc->ircd, &prefix, channel);
+            peer_set_nick(mc, peer, channel, strlen(channel));
+            printf("%s nick: %s\n", sprint_addrport(in), channel);
+            break;
+        case EVENT_GREETING_REQ:
+            // anyone can ask for our channels, so only peers we know get
+            // them, and no more often than their greetings allow
+            if (mc->store.status[peer->id] != PEER_ACTIVE) {
+                break;
+            }
+            peer->sent_digest = 0;
+            uint64_t at = peer->last_greeted +
+                1000 * MESHCHAT_GREET_REQ_INTERVAL;
+            if (mc->store.next_greet[peer->id] > at) {
+                mc->store.next_greet[peer->id] = at;
+                peer_schedule(mc, peer);
+            }
+            break;
+        default:
+            // transport events only come bare
             break;
     };
 }
 
-// lookup a peer by ip, adding it if it is new
-peer_t *
-get_peer(meshchat_t *mc, const char *ip) {
+// lookup a peer by address, adding it if it is new
+static peer_t *
+peer_lookup(meshchat_t *mc, const struct in6_addr *addr) {
     peer_t *peer;
-    static char ip_copy[INET6_ADDRSTRLEN];
+    khiter_t k;
+    int ret;
 
-    // canonicalize the ipv6 string
-    if (!canonicalize_ipv6(ip_copy, ip)) {
-        fprintf(stderr, "Failed to canonicalize ip %s\n", ip);
+    k = kh_get(peer, mc->peers, *addr);
+    if (k != kh_end(mc->peers)) {
+        // we have already seen this ip
+        return peerstore_get(&mc->store, kh_value(mc->peers, k));
     }
-
-    //printf("ip: %s, peers: %u\n", ip_copy, hash_size(mc->peers));
-    if (hash_size(mc->peers)) {
-        peer = hash_get(mc->peers, (char *)ip_copy);
-        if (peer) {
-            // we have already seen this ip
-            return peer;
-        }
+    if (mc->store.count >= MESHCHAT_PEERS_MAX && peers_make_room(mc) < 0) {
+        mc->stats.peers_refused++;
+        return NULL;
+    }
+    k = kh_put(peer, mc->peers, *addr, &ret);
+    if (ret < 0) {
+        fprintf(stderr, "Unable to add peer\n");
+        return NULL;
     }
 
     // new peer. add to the list
-    peer = peer_new(ip_copy);
-    if (!peer) {
+    peer = peer_new(addr);
+    if (peer) {
+        peer->id = peerstore_add(&mc->store, peer);
+    }
+    if (!peer || peer->id == PEER_ID_NONE) {
         fprintf(stderr, "Unable to create peer\n");
+        kh_del(peer, mc->peers, k);
+        free(peer);
         return NULL;
     }
-    hash_set(mc->peers, peer->ip, (void *)peer);
+    kh_value(mc->peers, k) = peer->id;
+    // peers that send to us first may be in the routing table already
+    peer->listed = cjdnsadmin_has_route(mc->cjdnsadmin, addr);
+    // new peers are greeted at a random point in the ping interval, so
+    // that a batch of them found at once doesn't get greeted at once
+    mc->store.next_greet[peer->id] = uv_now(uv_default_loop()) +
+        mc_random(mc) % (1000 * MESHCHAT_PING_INTERVAL);
+    peer_schedule(mc, peer);
     return peer;
 }
 
+// lookup a peer by the text form of their ip, adding it if it is new
+peer_t *
+get_peer(meshchat_t *mc, const char *ip) {
+    struct in6_addr addr;
+    if (inet_pton(AF_INET6, ip, &addr) != 1) {
+        fprintf(stderr, "Bad peer ip %s\n", ip);
+        return NULL;
+    }
+    return peer_lookup(mc, &addr);
+}
+
+// text form of a peer's ip, made the first time it is needed
+static const char *
+peer_ip(peer_t *peer) {
+    if (!peer->ip[0] && !inet_ntop(AF_INET6, &peer->addr.sin6_addr,
+                peer->ip, sizeof(peer->ip))) {
+        perror("inet_ntop");
+    }
+    return peer->ip;
+}
+
+void
+found_ip(void *obj, const struct in6_addr *ip) {
+    meshchat_t *mc = (meshchat_t *)obj;
+    peer_t *peer = peer_lookup(mc, ip);
+    if (peer) {
+        peer->listed = 1;
+    }
+}
+
+// cjdns dropped a node from its routing table
 void
-found_ip(void *obj, const char *ip) {
+lost_ip(void *obj, const struct in6_addr *ip) {
     meshchat_t *mc = (meshchat_t *)obj;
-    get_peer(mc, ip);
+    khiter_t k = kh_get(peer, mc->peers, *ip);
+    peer_t *peer;
+    if (k == kh_end(mc->peers)) {
+        return;
+    }
+    peer = peerstore_get(&mc->store, kh_value(mc->peers, k));
+    peer->listed = 0;
+    if (peer != mc->me && (mc->store.status[peer->id] == PEER_UNKNOWN ||
+                peer_stale(mc, peer, uv_now(uv_default_loop())))) {
+        // we never got to greet them, or they are long gone
+        peer_evict(mc, peer);
+        mc->stats.evicted_aged++;
+    }
 }
 
 peer_t *
-peer_new(const char *ip) {
+peer_new(const struct in6_addr *addr) {
     peer_t *peer = (peer_t *)malloc(sizeof(peer_t));
     if (!peer) {
         return NULL;
     }
-    peer->status = PEER_UNKNOWN;
-    ZERO(peer->last_greeted);
-    ZERO(peer->last_message);
+    peer->id = PEER_ID_NONE;
+    peer->last_greeted = 0;
+    peer->listed = 0;
+    timerwheel_timer_init(&peer->timer, peer);
     peer->nick = NULL;
-    strcpy(peer->ip, ip);
+    peer->nick_next = NULL;
+    peer->caps = 0;
+    peer->rel = NULL;
+    peer->tokens = MESHCHAT_PACE_PEER_BURST;
+    peer->refill = 0;
+    peer->queue_head = peer->queue_tail = NULL;
+    peer->queue_len = peer->queue_max = 0;
+    peer->pace_dropped = 0;
+    peer->pace_delay_max = 0;
+    peer->digest = 0;
+    peer->sent_digest = 0;
+    peer->chans = NULL;
+    peer->chans_n = peer->chans_capacity = 0;
+    peer->paced = 0;
+    peer->paced_next = NULL;
+    peer->bundle = NULL;
+    peer->bundle_n = 0;
+    peer->coalescing = 0;
+    peer->coalesce_next = NULL;
+    peer->ip[0] = '\0';
     memset(&peer->addr, 0, sizeof(peer->addr));
     peer->addr.sin6_family = AF_INET6;
     peer->addr.sin6_port = htons(MESHCHAT_PORT);
-    inet_pton(AF_INET6, ip, &(peer->addr.sin6_addr));
+    peer->addr.sin6_addr = *addr;
     return peer;
 }
 
+static void
+send_req_done(meshchat_t *mc, struct send_req *sr) {
+    if (sr->packet) {
+        packet_unref(mc, sr->packet);
+    }
+    pool_put(&mc->send_pool, sr);
+}
+
 void on_sent(uv_udp_send_t* sent, int status) {
     CHECK(status);
     //printf("sent \"%*s\" (%zu) to %s\n", (int)len-1, msg, len,
         //sprint_addrport((struct sockaddr *)&peer->addr));
-    free(sent);
+    send_req_done(sent->data, (struct send_req *)sent);
 }
 
+// send a header and/or packet to a peer asynchronously. the header is
+// copied and the packet is kept alive until the send completes
 void
-peer_send(meshchat_t *mc, peer_t *peer, char *msg, size_t len) {
-    // probably need a uv_udp_send_t for each send, so can send to multiple peers
-    // without getting addresses mixed up? XXX: maybe not?
-    
-    uv_udp_send_t* req = NEW(uv_udp_send_t);
-    uv_buf_t buf;
-    buf.base = msg;
-    buf.len = len;
-    uv_udp_send(req,&mc->handle, &buf, 1, (struct sockaddr *)&peer->addr, on_sent);
+peer_send(meshchat_t *mc, peer_t *peer, const char *hdr, size_t hdr_len,
+        struct packet *pkt) {
+    struct send_req *sr = pool_get(&mc->send_pool);
+    uv_buf_t bufs[2];
+    unsigned int nbufs = 0;
+    if (!sr) {
+        mc->stats.send_errors++;
+        return;
+    }
+    sr->req.data = mc;
+    sr->hdr_len = hdr_len;
+    sr->packet = pkt ? packet_ref(pkt) : NULL;
+    if (hdr_len) {
+        memcpy(sr->hdr, hdr, hdr_len);
+        bufs[nbufs].base = sr->hdr;
+        bufs[nbufs].len = hdr_len;
+        nbufs++;
+    }
+    if (pkt) {
+        bufs[nbufs].base = pkt->data;
+        bufs[nbufs].len = pkt->len;
+        nbufs++;
+    }
+    if (uv_udp_send(&sr->req, &mc->handle, bufs, nbufs,
+                (struct sockaddr *)&peer->addr, on_sent) < 0) {
+        send_req_done(mc, sr);
+        mc->stats.send_errors++;
+        return;
+    }
+    mc->stats.send_queued++;
 }
 
-static inline void
-service_peer(meshchat_t *mc, peer_t *peer) {
-    if (peer == mc->me) {
+// queue a header and/or packet for the next batch flush
+static void
+batch_add(meshchat_t *mc, peer_t *peer, const char *hdr, size_t hdr_len,
+        struct packet *pkt) {
+    struct send_batch *batch = &mc->batch;
+    if (batch->n == MESHCHAT_SEND_BATCH) {
+        batch_flush(mc);
+    }
+    batch->peers[batch->n] = peer;
+    batch->packets[batch->n] = pkt ? packet_ref(pkt) : NULL;
+    batch->hdr_len[batch->n] = hdr_len;
+    if (hdr_len) {
+        memcpy(batch->hdr[batch->n], hdr, hdr_len);
+    }
+    batch->n++;
+}
+
+// send the collected datagrams with as few syscalls as possible.
+// whatever the socket does not take right away is queued through libuv.
+static void
+batch_flush(meshchat_t *mc) {
+    struct send_batch *batch = &mc->batch;
+    size_t i, sent = 0;
+
+    if (!batch->n) {
         return;
     }
-    switch (peer->status) {
-        // greet new unknown peer
-        case PEER_UNKNOWN:
-            greet_peer(mc, peer);
-            peer->status = PEER_CONTACTED;
-            current_clock(&peer->last_message);
-            break;
-        case PEER_CONTACTED:
-        case PEER_ACTIVE:
-            if (time_since(&peer->last_greeted) > MESHCHAT_PING_INTERVAL) {
-                // ping active peer
-                greet_peer(mc, peer);
+
+#ifdef MESHCHAT_HAVE_SENDMMSG
+    uv_os_fd_t fd;
+    // bypass libuv only while its queue is empty, to keep datagrams in order
+    if (mc->handle.send_queue_count == 0 &&
+            uv_fileno((uv_handle_t *)&mc->handle, &fd) == 0) {
+        for (i = 0; i < batch->n; i++) {
+            struct msghdr *hdr = &batch->msgs[i].msg_hdr;
+            memset(hdr, 0, sizeof(*hdr));
+            hdr->msg_name = &batch->peers[i]->addr;
+            hdr->msg_namelen = sizeof(batch->peers[i]->addr);
+            hdr->msg_iov = batch->iov[i];
+            if (batch->hdr_len[i]) {
+                batch->iov[i][hdr->msg_iovlen].iov_base = batch->hdr[i];
+                batch->iov[i][hdr->msg_iovlen].iov_len = batch->hdr_len[i];
+                hdr->msg_iovlen++;
             }
-            if (time_since(&peer->last_message) > MESHCHAT_TIMEOUT) {
-                // mark unreponsive peer as timed out
-                if (peer->status == PEER_ACTIVE) {
+            if (batch->packets[i]) {
+                batch->iov[i][hdr->msg_iovlen].iov_base =
+                    batch->packets[i]->data;
+                batch->iov[i][hdr->msg_iovlen].iov_len =
+                    batch->packets[i]->len;
+                hdr->msg_iovlen++;
+            }
+        }
+        while (sent < batch->n) {
+            int rc = sendmmsg(fd, batch->msgs + sent, batch->n - sent, 0);
+            mc->stats.batch_syscalls++;
+            if (rc < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                // the first remaining destination failed. skip it
+                perror("sendmmsg");
+                mc->stats.send_errors++;
+                sent++;
+                continue;
+            }
+            sent += rc;
+        }
+        mc->stats.batches++;
+        mc->stats.batch_sent += sent;
+        mc->stats.batch_last = sent;
+        if (sent > mc->stats.batch_max) {
+            mc->stats.batch_max = sent;
+        }
+    }
+#endif
+
+    for (i = sent; i < batch->n; i++) {
+        peer_send(mc, batch->peers[i], batch->hdr[i], batch->hdr_len[i],
+                batch->packets[i]);
+    }
+    for (i = 0; i < batch->n; i++) {
+        if (batch->packets[i]) {
+            packet_unref(mc, batch->packets[i]);
+        }
+    }
+    batch->n = 0;
+}
+
+// sequence number comparison, safe across wraparound
+static inline int
+seq_before(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) < 0;
+}
+
+static struct rel_state *
+rel_get(meshchat_t *mc, peer_t *peer) {
+    struct rel_state *rel = peer->rel;
+    if (rel) {
+        return rel;
+    }
+    rel = calloc(1, sizeof(struct rel_state));
+    if (!rel) {
+        perror("calloc");
+        return NULL;
+    }
+    rel->peer = peer;
+    rel->rto = MESHCHAT_REL_RTO_INIT;
+    peer->rel = rel;
+    return rel;
+}
+
+static void
+rel_inflight_add(meshchat_t *mc, struct rel_state *rel) {
+    if (rel->inflight) {
+        return;
+    }
+    rel->inflight = 1;
+    rel->inflight_prev = NULL;
+    rel->inflight_next = mc->rel_inflight;
+    if (mc->rel_inflight) {
+        mc->rel_inflight->inflight_prev = rel;
+    } else {
+        uv_timer_start(&mc->rel_timer, rel_tick,
+                MESHCHAT_REL_TICK, MESHCHAT_REL_TICK);
+    }
+    mc->rel_inflight = rel;
+}
+
+static void
+rel_inflight_remove(meshchat_t *mc, struct rel_state *rel) {
+    if (!rel->inflight) {
+        return;
+    }
+    if (rel->inflight_prev) {
+        rel->inflight_prev->inflight_next = rel->inflight_next;
+    } else {
+        mc->rel_inflight = rel->inflight_next;
+    }
+    if (rel->inflight_next) {
+        rel->inflight_next->inflight_prev = rel->inflight_prev;
+    }
+    rel->inflight = 0;
+}
+
+// drop all reliability state for a peer, e.g. when they time out
+static void
+rel_reset(meshchat_t *mc, peer_t *peer) {
+    struct rel_state *rel = peer->rel;
+    size_t i;
+    if (!rel) {
+        return;
+    }
+    rel_inflight_remove(mc, rel);
+    for (i = 0; i < MESHCHAT_REL_WINDOW; i++) {
+        if (rel->tx[i].pkt) {
+            packet_unref(mc, rel->tx[i].pkt);
+        }
+        if (rel->rx[i]) {
+            packet_unref(mc, rel->rx[i]);
+        }
+    }
+    for (i = 0; i < rel->backlog_len; i++) {
+        packet_unref(mc, rel->backlog[
+                (rel->backlog_head + i) % MESHCHAT_REL_BACKLOG]);
+    }
+    free(rel);
+    peer->rel = NULL;
+}
+
+static void
+rel_transmit(meshchat_t *mc, struct rel_state *rel, uint32_t seq) {
+    struct rel_slot *slot = &rel->tx[seq % MESHCHAT_REL_WINDOW];
+    char hdr[MESHCHAT_HDR_MAX];
+    hdr[0] = EVENT_DATA;
+    put_u32(hdr + 1, mc->epoch);
+    put_u32(hdr + 5, seq);
+    put_u32(hdr + 9, rel->una);
+    slot->tries++;
+    // if pacing holds it back, it counts as sent once it leaves the queue
+    slot->sent_at = uv_now(uv_default_loop());
+    slot->queued = pace_send(mc, rel->peer, hdr, 13, slot->pkt) > 0;
+}
+
+// a reliable packet held back by pacing is going out now
+static void
+rel_dequeued(peer_t *peer, struct send_req *sr, uint64_t now) {
+    struct rel_slot *slot;
+    if (!peer->rel || sr->hdr_len != 13 || sr->hdr[0] != EVENT_DATA) {
+        return;
+    }
+    slot = &peer->rel->tx[get_u32(sr->hdr + 5) % MESHCHAT_REL_WINDOW];
+    if (slot->pkt == sr->packet) {
+        slot->sent_at = now;
+        slot->queued = 0;
+    }
+}
+
+// put a packet in the window and send it. takes over a reference
+static void
+rel_push(meshchat_t *mc, struct rel_state *rel, struct packet *pkt) {
+    uint32_t seq = rel->next_seq++;
+    struct rel_slot *slot = &rel->tx[seq % MESHCHAT_REL_WINDOW];
+    slot->pkt = pkt;
+    slot->tries = 0;
+    rel_transmit(mc, rel, seq);
+    rel_inflight_add(mc, rel);
+    mc->stats.rel_sent++;
+}
+
+// move acknowledged and abandoned packets out of the window, and let
+// waiting packets in
+static void
+rel_advance(meshchat_t *mc, struct rel_state *rel) {
+    while (rel->una != rel->next_seq &&
+            !rel->tx[rel->una % MESHCHAT_REL_WINDOW].pkt) {
+        rel->una++;
+    }
+    while (rel->backlog_len &&
+            rel->next_seq - rel->una < MESHCHAT_REL_WINDOW) {
+        struct packet *pkt = rel->backlog[rel->backlog_head];
+        rel->backlog_head = (rel->backlog_head + 1) % MESHCHAT_REL_BACKLOG;
+        rel->backlog_len--;
+        rel_push(mc, rel, pkt);
+    }
+    if (rel->una == rel->next_seq) {
+        rel_inflight_remove(mc, rel);
+    }
+}
+
+// send a packet reliably, or queue it if the window is full
+static void
+rel_send(meshchat_t *mc, peer_t *peer, struct packet *pkt) {
+    struct rel_state *rel = rel_get(mc, peer);
+    if (!rel) {
+        pace_send(mc, peer, NULL, 0, pkt);
+        return;
+    }
+    if (rel->backlog_len || rel->next_seq - rel->una >= MESHCHAT_REL_WINDOW) {
+        if (rel->backlog_len == MESHCHAT_REL_BACKLOG) {
+            mc->stats.rel_backlog_drops++;
+            return;
+        }
+        rel->backlog[(rel->backlog_head + rel->backlog_len) %
+            MESHCHAT_REL_BACKLOG] = packet_ref(pkt);
+        rel->backlog_len++;
+        return;
+    }
+    rel_push(mc, rel, packet_ref(pkt));
+}
+
+// RTO estimation as in RFC 6298
+static void
+rel_rtt_sample(struct rel_state *rel, double rtt) {
+    if (!rel->rtt_valid) {
+        rel->srtt = rtt;
+        rel->rttvar = rtt / 2;
+        rel->rtt_valid = 1;
+    } else {
+        double err = rel->srtt - rtt;
+        if (err < 0) {
+            err = -err;
+        }
+        rel->rttvar = 0.75 * rel->rttvar + 0.25 * err;
+        rel->srtt = 0.875 * rel->srtt + 0.125 * rtt;
+    }
+    double var = 4 * rel->rttvar;
+    if (var < MESHCHAT_REL_TICK) {
+        var = MESHCHAT_REL_TICK;
+    }
+    rel->rto = rel->srtt + var;
+    if (rel->rto < MESHCHAT_REL_RTO_MIN) {
+        rel->rto = MESHCHAT_REL_RTO_MIN;
+    } else if (rel->rto > MESHCHAT_REL_RTO_MAX) {
+        rel->rto = MESHCHAT_REL_RTO_MAX;
+    }
+}
+
+static void
+rel_acked(meshchat_t *mc, struct rel_state *rel, uint32_t seq, uint64_t now) {
+    struct rel_slot *slot = &rel->tx[seq % MESHCHAT_REL_WINDOW];
+    if (!slot->pkt) {
+        return;
+    }
+    // Karn: only sample packets that were sent once
+    if (slot->tries == 1) {
+        rel_rtt_sample(rel, now - slot->sent_at);
+    }
+    packet_unref(mc, slot->pkt);
+    slot->pkt = NULL;
+}
+
+// ack: epoch, next expected seq, bit i set if seq next+1+i was received
+static void
+rel_recv_ack(meshchat_t *mc, peer_t *peer, const char *msg, size_t len) {
+    struct rel_state *rel = peer->rel;
+    uint64_t now = uv_now(uv_default_loop());
+    uint32_t cum, sack, seq;
+    int i;
+
+    if (len < 13 || !rel || get_u32(msg + 1) != mc->epoch) {
+        // not for our current stream
+        return;
+    }
+    cum = get_u32(msg + 5);
+    sack = get_u32(msg + 9);
+    if (seq_before(rel->next_seq, cum)) {
+        // acks something we never sent
+        return;
+    }
+    mc->stats.rel_acks_recv++;
+
+    if (seq_before(rel->una, cum)) {
+        for (seq = rel->una; seq != cum; seq++) {
+            rel_acked(mc, rel, seq, now);
+        }
+        rel->una = cum;
+        rel->dupacks = 0;
+    } else if (sack) {
+        rel->dupacks++;
+    }
+    for (i = 0; i < 32; i++) {
+        seq = cum + 1 + i;
+        if (!seq_before(seq, rel->next_seq)) {
+            break;
+        }
+        if (seq_before(seq, rel->una)) {
+            continue;
+        }
+        if (sack & (1u << i)) {
+            rel_acked(mc, rel, seq, now);
+        }
+    }
+
+    // later packets keep arriving: resend the hole without waiting,
+    // unless it is still waiting to go out
+    if (rel->dupacks >= 3 && rel->una != rel->next_seq &&
+            rel->tx[rel->una % MESHCHAT_REL_WINDOW].pkt &&
+            !rel->tx[rel->una % MESHCHAT_REL_WINDOW].queued) {
+        rel_transmit(mc, rel, rel->una);
+        rel->dupacks = 0;
+        mc->stats.rel_fast_retransmits++;
+    }
+
+    rel_advance(mc, rel);
+}
+
+static void
+rel_ack_schedule(meshchat_t *mc, peer_t *peer) {
+    struct rel_state *rel = peer->rel;
+    if (rel->ack_pending) {
+        return;
+    }
+    if (mc->acks_n == MESHCHAT_RECV_BATCH) {
+        rel_ack_flush(mc);
+    }
+    rel->ack_pending = 1;
+    mc->acks[mc->acks_n++] = peer;
+}
+
+// send the acks owed for received data
+static void
+rel_ack_flush(meshchat_t *mc) {
+    char hdr[MESHCHAT_HDR_MAX];
+    size_t i;
+    int j;
+    for (i = 0; i < mc->acks_n; i++) {
+        peer_t *peer = mc->acks[i];
+        struct rel_state *rel = peer->rel;
+        if (!rel || !rel->ack_pending) {
+            continue;
+        }
+        uint32_t sack = 0;
+        for (j = 0; j < 32 && j + 1 < MESHCHAT_REL_WINDOW; j++) {
+            if (rel->rx[(rel->rx_next + 1 + j) % MESHCHAT_REL_WINDOW]) {
+                sack |= 1u << j;
+            }
+        }
+        hdr[0] = EVENT_ACK;
+        put_u32(hdr + 1, rel->rx_epoch);
+        put_u32(hdr + 5, rel->rx_next);
+        put_u32(hdr + 9, sack);
+        batch_add(mc, peer, hdr, 13, NULL);
+        rel->ack_pending = 0;
+        mc->stats.rel_acks_sent++;
+    }
+    mc->acks_n = 0;
+}
+
+// hand buffered packets to the event handler in order
+static void
+rel_deliver(meshchat_t *mc, peer_t *peer, struct rel_state *rel) {
+    struct packet *pkt;
+    while ((pkt = rel->rx[rel->rx_next % MESHCHAT_REL_WINDOW])) {
+        rel->rx[rel->rx_next % MESHCHAT_REL_WINDOW] = NULL;
+        rel->rx_next++;
+        mc->stats.rel_delivered++;
+        handle_event(mc, peer, pkt->data, pkt->len);
+        packet_unref(mc, pkt);
+        if (peer->rel != rel) {
+            // the event reset the peer
+            return;
+        }
+    }
+}
+
+// data: epoch, seq, sender's oldest unacked seq, event
+static void
+rel_recv_data(meshchat_t *mc, peer_t *peer, const char *msg, size_t len) {
+    struct rel_state *rel;
+    uint32_t epoch, seq, una;
+    const char *event = msg + 13;
+    size_t event_len = len - 13;
+
+    if (len <= 13 || event[0] == EVENT_DATA || event[0] == EVENT_ACK) {
+        return;
+    }
+    rel = rel_get(mc, peer);
+    if (!rel) {
+        handle_event(mc, peer, event, event_len);
+        return;
+    }
+    epoch = get_u32(msg + 1);
+    seq = get_u32(msg + 5);
+    una = get_u32(msg + 9);
+
+    if (epoch != rel->rx_epoch) {
+        // new stream: they restarted, or this is the first we see of them
+        size_t i;
+        for (i = 0; i < MESHCHAT_REL_WINDOW; i++) {
+            if (rel->rx[i]) {
+                packet_unref(mc, rel->rx[i]);
+                rel->rx[i] = NULL;
+            }
+        }
+        rel->rx_epoch = epoch;
+        rel->rx_next = una;
+    }
+
+    // the sender gave up on everything before una. deliver what we have
+    // of it and skip the rest
+    if (seq_before(rel->rx_next, una)) {
+        uint32_t stop = una - rel->rx_next > MESHCHAT_REL_WINDOW ?
+            rel->rx_next + MESHCHAT_REL_WINDOW : una;
+        for (seq = rel->rx_next; seq != stop; seq++) {
+            struct packet *pkt = rel->rx[seq % MESHCHAT_REL_WINDOW];
+            if (!pkt) {
+                continue;
+            }
+            rel->rx[seq % MESHCHAT_REL_WINDOW] = NULL;
+            rel->rx_next = seq + 1;
+            mc->stats.rel_delivered++;
+            handle_event(mc, peer, pkt->data, pkt->len);
+            packet_unref(mc, pkt);
+            if (peer->rel != rel) {
+                return;
+            }
+        }
+        rel->rx_next = una;
+        rel_deliver(mc, peer, rel);
+        if (peer->rel != rel) {
+            return;
+        }
+    }
+
+    rel_ack_schedule(mc, peer);
+
+    if (seq_before(seq, rel->rx_next)) {
+        mc->stats.rel_duplicates++;
+    } else if (seq - rel->rx_next >= MESHCHAT_REL_WINDOW) {
+        // beyond the window. the sender will retry
+    } else if (seq == rel->rx_next) {
+        // the common case: deliver straight from the receive buffer
+        rel->rx_next++;
+        mc->stats.rel_delivered++;
+        handle_event(mc, peer, event, event_len);
+        if (peer->rel == rel) {
+            rel_deliver(mc, peer, rel);
+        }
+    } else if (rel->rx[seq % MESHCHAT_REL_WINDOW]) {
+        mc->stats.rel_duplicates++;
+    } else {
+        struct packet *pkt = packet_new(mc);
+        if (!pkt) {
+            return;
+        }
+        memcpy(pkt->data, event, event_len);
+        pkt->data[event_len] = '\0';
+        pkt->len = event_len;
+        rel->rx[seq % MESHCHAT_REL_WINDOW] = pkt;
+        mc->stats.rel_out_of_order++;
+    }
+}
+
+// retransmit packets whose timeout expired
+static void
+rel_check_timeouts(meshchat_t *mc, struct rel_state *rel, uint64_t now) {
+    int backoff = 0;
+    uint32_t seq;
+    for (seq = rel->una; seq != rel->next_seq; seq++) {
+        struct rel_slot *slot = &rel->tx[seq % MESHCHAT_REL_WINDOW];
+        if (!slot->pkt || slot->queued || now - slot->sent_at < rel->rto) {
+            continue;
+        }
+        if (slot->tries >= MESHCHAT_REL_MAX_TRIES) {
+            packet_unref(mc, slot->pkt);
+            slot->pkt = NULL;
+            mc->stats.rel_expired++;
+            continue;
+        }
+        rel_transmit(mc, rel, seq);
+        mc->stats.rel_retransmits++;
+        backoff = 1;
+    }
+    if (backoff) {
+        rel->rto *= 2;
+        if (rel->rto > MESHCHAT_REL_RTO_MAX) {
+            rel->rto = MESHCHAT_REL_RTO_MAX;
+        }
+    }
+    rel_advance(mc, rel);
+}
+
+static void
+rel_tick(uv_timer_t *timer) {
+    meshchat_t *mc = timer->data;
+    uint64_t now = uv_now(uv_default_loop());
+    struct rel_state *rel, *next;
+    for (rel = mc->rel_inflight; rel; rel = next) {
+        next = rel->inflight_next;
+        rel_check_timeouts(mc, rel, now);
+    }
+    batch_flush(mc);
+    if (!mc->rel_inflight) {
+        uv_timer_stop(timer);
+    }
+}
+
+// send a packet to a peer, reliably if they support it
+static void
+peer_transmit_now(meshchat_t *mc, peer_t *peer, struct packet *pkt) {
+    if (peer->caps & PEER_CAP_RELIABLE) {
+        rel_send(mc, peer, pkt);
+    } else {
+        pace_send(mc, peer, NULL, 0, pkt);
+    }
+}
+
+// send a peer's held events
+static void
+coalesce_flush(meshchat_t *mc, peer_t *peer) {
+    struct packet *pkt = peer->bundle;
+    if (peer->bundle_n == 1) {
+        // a bundle of one is just the event
+        pkt->len = get_u16(pkt->data + 1);
+        memmove(pkt->data, pkt->data + 3, pkt->len + 1);
+    }
+    peer->bundle = NULL;
+    peer->bundle_n = 0;
+    mc->stats.coalesce_sent++;
+    peer_transmit_now(mc, peer, pkt);
+    packet_unref(mc, pkt);
+}
+
+static void
+coalesce_tick(uv_timer_t *timer) {
+    meshchat_t *mc = timer->data;
+    peer_t *peer;
+    while ((peer = mc->coalescing)) {
+        mc->coalescing = peer->coalesce_next;
+        peer->coalescing = 0;
+        if (peer->bundle) {
+            coalesce_flush(mc, peer);
+        }
+    }
+    batch_flush(mc);
+}
+
+// drop a peer's held events, e.g. when they time out. they leave the
+// coalescing list on the next tick
+static void
+coalesce_reset(meshchat_t *mc, peer_t *peer) {
+    if (peer->bundle) {
+        mc->stats.coalesce_dropped += peer->bundle_n;
+        packet_unref(mc, peer->bundle);
+        peer->bundle = NULL;
+        peer->bundle_n = 0;
+    }
+}
+
+// hold an event for a peer, to send it in one datagram with the events
+// that follow within MESHCHAT_COALESCE_DELAY
+static void
+peer_transmit(meshchat_t *mc, peer_t *peer, struct packet *pkt) {
+    struct packet *bundle = peer->bundle;
+    if (!(peer->caps & PEER_CAP_BUNDLE) ||
+            pkt->len + 4 > MESHCHAT_PAYLOAD_LEN) {
+        // keep it behind the events already held
+        if (bundle) {
+            coalesce_flush(mc, peer);
+        }
+        peer_transmit_now(mc, peer, pkt);
+        return;
+    }
+    if (bundle && bundle->len + pkt->len + 3 > MESHCHAT_PAYLOAD_LEN) {
+        mc->stats.coalesce_full++;
+        coalesce_flush(mc, peer);
+        bundle = NULL;
+    }
+    if (!bundle) {
+        bundle = packet_new(mc);
+        if (!bundle) {
+            peer_transmit_now(mc, peer, pkt);
+            return;
+        }
+        bundle->data[0] = EVENT_BUNDLE;
+        bundle->len = 1;
+        peer->bundle = bundle;
+    }
+    if (!peer->coalescing) {
+        if (!mc->coalescing) {
+            uv_timer_start(&mc->coalesce_timer, coalesce_tick,
+                    MESHCHAT_COALESCE_DELAY, 0);
+        }
+        peer->coalescing = 1;
+        peer->coalesce_next = mc->coalescing;
+        mc->coalescing = peer;
+    }
+    // each event is NUL-terminated, so it can be handled in place
+    put_u16(bundle->data + bundle->len, pkt->len);
+    memcpy(bundle->data + bundle->len + 2, pkt->data, pkt->len);
+    bundle->data[bundle->len + 2 + pkt->len] = '\0';
+    bundle->len += pkt->len + 3;
+    peer->bundle_n++;
+    mc->stats.coalesce_events++;
+}
+
+// bundle: length, event, NUL, ...
+static void
+bundle_recv(meshchat_t *mc, peer_t *peer, const char *msg, size_t len) {
+    const char *p = msg + 1;
+    const char *end = msg + len;
+    while (end - p >= 4) {
+        size_t event_len = get_u16(p);
+        const char *event = p + 2;
+        if (!event_len || event_len + 3 > (size_t)(end - p) ||
+                event[event_len] != '\0') {
+            break;
+        }
+        switch (event[0]) {
+            case EVENT_DATA:
+            case EVENT_ACK:
+            case EVENT_BUNDLE:
+                break;
+            default:
+                handle_event(mc, peer, event, event_len);
+        }
+        p = event + event_len + 1;
+    }
+}
+
+// split an event into fragments. returns how many, or 0 if out of memory
+static size_t
+frag_split(meshchat_t *mc, const char *event, size_t len,
+        struct packet **frags) {
+    size_t n = (len + MESHCHAT_FRAG_DATA - 1) / MESHCHAT_FRAG_DATA;
+    uint32_t id = mc->frag_id++;
+    size_t i;
+    for (i = 0; i < n; i++) {
+        size_t offset = i * MESHCHAT_FRAG_DATA;
+        size_t frag_len = len - offset < MESHCHAT_FRAG_DATA ?
+            len - offset : MESHCHAT_FRAG_DATA;
+        struct packet *pkt = packet_new(mc);
+        if (!pkt) {
+            while (i--) {
+                packet_unref(mc, frags[i]);
+            }
+            return 0;
+        }
+        pkt->data[0] = EVENT_FRAG;
+        put_u32(pkt->data + 1, id);
+        pkt->data[5] = i;
+        pkt->data[6] = n;
+        memcpy(pkt->data + MESHCHAT_FRAG_HDR, event + offset, frag_len);
+        pkt->len = MESHCHAT_FRAG_HDR + frag_len;
+        frags[i] = pkt;
+    }
+    mc->stats.frag_events++;
+    mc->stats.frag_sent += n;
+    return n;
+}
+
+static void
+frag_free(meshchat_t *mc, struct frag_entry *entry) {
+    free(entry->data);
+    entry->data = NULL;
+    mc->frag_mem -= entry->size;
+}
+
+// drop reassemblies that have waited too long for their fragments
+static void
+frag_expire(meshchat_t *mc, uint64_t now) {
+    size_t i;
+    for (i = 0; i < MESHCHAT_FRAG_SLOTS; i++) {
+        struct frag_entry *entry = &mc->frags[i];
+        if (entry->data && now - entry->started > MESHCHAT_FRAG_TIMEOUT) {
+            frag_free(mc, entry);
+            mc->stats.frag_expired++;
+        }
+    }
+}
+
+// drop a peer's reassemblies, e.g. when they time out
+static void
+frag_reset(meshchat_t *mc, peer_t *peer) {
+    size_t i;
+    for (i = 0; i < MESHCHAT_FRAG_SLOTS; i++) {
+        if (mc->frags[i].data && mc->frags[i].peer == peer) {
+            frag_free(mc, &mc->frags[i]);
+        }
+    }
+}
+
+// oldest reassembly in the table, or of one peer
+static struct frag_entry *
+frag_oldest(meshchat_t *mc, peer_t *peer) {
+    struct frag_entry *oldest = NULL;
+    size_t i;
+    for (i = 0; i < MESHCHAT_FRAG_SLOTS; i++) {
+        struct frag_entry *entry = &mc->frags[i];
+        if (entry->data && (!peer || entry->peer == peer) &&
+                (!oldest || entry->started < oldest->started)) {
+            oldest = entry;
+        }
+    }
+    return oldest;
+}
+
+// start reassembling an event, making room by dropping the oldest
+// reassembly if the peer, the table or the memory budget is full
+static struct frag_entry *
+frag_start(meshchat_t *mc, peer_t *peer, uint32_t id, unsigned int count,
+        uint64_t now) {
+    struct frag_entry *entry = NULL;
+    size_t size = count * MESHCHAT_FRAG_DATA + 1;
+    unsigned int peer_n = 0;
+    size_t i;
+    for (i = 0; i < MESHCHAT_FRAG_SLOTS; i++) {
+        if (!mc->frags[i].data) {
+            if (!entry) {
+                entry = &mc->frags[i];
+            }
+        } else if (mc->frags[i].peer == peer) {
+            peer_n++;
+        }
+    }
+    if (peer_n >= MESHCHAT_FRAG_PER_PEER) {
+        entry = frag_oldest(mc, peer);
+        frag_free(mc, entry);
+        mc->stats.frag_evicted++;
+    } else if (!entry) {
+        entry = frag_oldest(mc, NULL);
+        frag_free(mc, entry);
+        mc->stats.frag_evicted++;
+    }
+    while (mc->frag_mem + size > MESHCHAT_FRAG_MEMORY) {
+        struct frag_entry *oldest = frag_oldest(mc, NULL);
+        frag_free(mc, oldest);
+        mc->stats.frag_evicted++;
+    }
+
+    entry->data = malloc(size);
+    if (!entry->data) {
+        perror("malloc");
+        return NULL;
+    }
+    entry->peer = peer;
+    entry->id = id;
+    entry->count = count;
+    entry->received = 0;
+    entry->have = 0;
+    entry->len = 0;
+    entry->size = size;
+    entry->started = now;
+    mc->frag_mem += size;
+    if (mc->frag_mem > mc->stats.frag_mem_max) {
+        mc->stats.frag_mem_max = mc->frag_mem;
+    }
+    return entry;
+}
+
+// frag: message id, index, count, data
+static void
+frag_recv(meshchat_t *mc, peer_t *peer, const char *msg, size_t len) {
+    uint64_t now = uv_now(uv_default_loop());
+    struct frag_entry *entry = NULL;
+    const char *data = msg + MESHCHAT_FRAG_HDR;
+    size_t data_len = len - MESHCHAT_FRAG_HDR;
+    uint32_t id;
+    unsigned int index, count;
+    size_t i;
+
+    if (len <= MESHCHAT_FRAG_HDR) {
+        return;
+    }
+    id = get_u32(msg + 1);
+    index = (unsigned char)msg[5];
+    count = (unsigned char)msg[6];
+    // all but the last fragment are full
+    if (count < 2 || count > MESHCHAT_FRAG_MAX || index >= count ||
+            data_len > MESHCHAT_FRAG_DATA ||
+            (index < count - 1 && data_len != MESHCHAT_FRAG_DATA)) {
+        return;
+    }
+
+    frag_expire(mc, now);
+    for (i = 0; i < MESHCHAT_FRAG_SLOTS; i++) {
+        if (mc->frags[i].data && mc->frags[i].peer == peer &&
+                mc->frags[i].id == id) {
+            entry = &mc->frags[i];
+            break;
+        }
+    }
+    if (!entry) {
+        entry = frag_start(mc, peer, id, count, now);
+        if (!entry) {
+            return;
+        }
+    } else if (entry->count != count || entry->have & (1u << index)) {
+        return;
+    }
+
+    memcpy(entry->data + index * MESHCHAT_FRAG_DATA, data, data_len);
+    entry->have |= 1u << index;
+    entry->received++;
+    if (index == count - 1) {
+        entry->len = index * MESHCHAT_FRAG_DATA + data_len;
+    }
+    if (entry->received < entry->count) {
+        return;
+    }
+
+    // complete. take the buffer out of the table before handling it
+    char *event = entry->data;
+    size_t event_len = entry->len;
+    entry->data = NULL;
+    mc->frag_mem -= entry->size;
+    mc->stats.frag_reassembled++;
+    event[event_len] = '\0';
+    switch (event[0]) {
+        case EVENT_DATA:
+        case EVENT_ACK:
+        case EVENT_BUNDLE:
+        case EVENT_FRAG:
+            break;
+        default:
+            handle_event(mc, peer, event, event_len);
+    }
+    free(event);
+}
+
+static inline void
+bucket_refill(double *tokens, uint64_t *last, uint64_t now,
+        double rate, double burst) {
+    *tokens += (now - *last) * rate / 1000;
+    if (*tokens > burst) {
+        *tokens = burst;
+    }
+    *last = now;
+}
+
+// send a datagram now if both the peer's and the global bucket allow it,
+// otherwise queue it behind the peer's other waiting datagrams.
+// header-only datagrams (acks) are never held back. returns 1 if it was
+// queued, 0 if it went to the batch and -1 if it was dropped
+static int
+pace_send(meshchat_t *mc, peer_t *peer, const char *hdr, size_t hdr_len,
+        struct packet *pkt) {
+    uint64_t now = uv_now(uv_default_loop());
+    struct send_req *sr;
+
+    if (!pkt) {
+        batch_add(mc, peer, hdr, hdr_len, pkt);
+        return 0;
+    }
+
+    bucket_refill(&peer->tokens, &peer->refill, now,
+            MESHCHAT_PACE_PEER_RATE, MESHCHAT_PACE_PEER_BURST);
+    bucket_refill(&mc->egress_tokens, &mc->egress_refill, now,
+            MESHCHAT_PACE_RATE, MESHCHAT_PACE_BURST);
+    if (!peer->queue_len && peer->tokens >= 1 && mc->egress_tokens >= 1) {
+        peer->tokens--;
+        mc->egress_tokens--;
+        mc->stats.pace_immediate++;
+        batch_add(mc, peer, hdr, hdr_len, pkt);
+        return 0;
+    }
+
+    if (peer->queue_len == MESHCHAT_PACE_QUEUE ||
+            !(sr = pool_get(&mc->send_pool))) {
+        peer->pace_dropped++;
+        mc->stats.pace_dropped++;
+        return -1;
+    }
+    sr->packet = packet_ref(pkt);
+    sr->hdr_len = hdr_len;
+    if (hdr_len) {
+        memcpy(sr->hdr, hdr, hdr_len);
+    }
+    sr->queued_at = now;
+    sr->next = NULL;
+    if (peer->queue_tail) {
+        peer->queue_tail->next = sr;
+    } else {
+        peer->queue_head = sr;
+    }
+    peer->queue_tail = sr;
+    peer->queue_len++;
+    if (peer->queue_len > peer->queue_max) {
+        peer->queue_max = peer->queue_len;
+    }
+    mc->stats.pace_queued++;
+    if (++mc->stats.pace_depth > mc->stats.pace_depth_max) {
+        mc->stats.pace_depth_max = mc->stats.pace_depth;
+    }
+
+    if (!peer->paced) {
+        peer->paced = 1;
+        peer->paced_next = NULL;
+        if (mc->paced_tail) {
+            mc->paced_tail->paced_next = peer;
+        } else {
+            mc->paced_head = peer;
+            uv_timer_start(&mc->pace_timer, pace_tick,
+                    MESHCHAT_PACE_TICK, MESHCHAT_PACE_TICK);
+        }
+        mc->paced_tail = peer;
+        mc->paced_len++;
+    }
+    return 1;
+}
+
+static struct send_req *
+pace_dequeue(meshchat_t *mc, peer_t *peer) {
+    struct send_req *sr = peer->queue_head;
+    peer->queue_head = sr->next;
+    if (!peer->queue_head) {
+        peer->queue_tail = NULL;
+    }
+    peer->queue_len--;
+    mc->stats.pace_depth--;
+    return sr;
+}
+
+// drop everything waiting for a peer, e.g. when they time out. the peer
+// leaves the round robin on the next tick
+static void
+pace_reset(meshchat_t *mc, peer_t *peer) {
+    while (peer->queue_len) {
+        struct send_req *sr = pace_dequeue(mc, peer);
+        peer->pace_dropped++;
+        mc->stats.pace_dropped++;
+        send_req_done(mc, sr);
+    }
+}
+
+// send waiting datagrams, one per peer per round, while the buckets allow
+static void
+pace_tick(uv_timer_t *timer) {
+    meshchat_t *mc = timer->data;
+    uint64_t now = uv_now(uv_default_loop());
+    size_t idle = 0;
+    peer_t *peer;
+
+    bucket_refill(&mc->egress_tokens, &mc->egress_refill, now,
+            MESHCHAT_PACE_RATE, MESHCHAT_PACE_BURST);
+    while ((peer = mc->paced_head) && mc->egress_tokens >= 1 &&
+            idle < mc->paced_len) {
+        mc->paced_head = peer->paced_next;
+        if (!mc->paced_head) {
+            mc->paced_tail = NULL;
+        }
+        mc->paced_len--;
+
+        bucket_refill(&peer->tokens, &peer->refill, now,
+                MESHCHAT_PACE_PEER_RATE, MESHCHAT_PACE_PEER_BURST);
+        if (peer->queue_len && peer->tokens >= 1) {
+            struct send_req *sr = pace_dequeue(mc, peer);
+            uint64_t delay = now - sr->queued_at;
+            peer->tokens--;
+            mc->egress_tokens--;
+            mc->stats.pace_delay_total += delay;
+            if (delay > mc->stats.pace_delay_max) {
+                mc->stats.pace_delay_max = delay;
+            }
+            if (delay > peer->pace_delay_max) {
+                peer->pace_delay_max = delay;
+            }
+            batch_add(mc, peer, sr->hdr, sr->hdr_len, sr->packet);
+            rel_dequeued(peer, sr, now);
+            send_req_done(mc, sr);
+            idle = 0;
+        } else {
+            // this peer is out of tokens
+            idle++;
+        }
+
+        if (peer->queue_len) {
+            peer->paced_next = NULL;
+            if (mc->paced_tail) {
+                mc->paced_tail->paced_next = peer;
+            } else {
+                mc->paced_head = peer;
+            }
+            mc->paced_tail = peer;
+            mc->paced_len++;
+        } else {
+            peer->paced = 0;
+        }
+    }
+    batch_flush(mc);
+    if (!mc->paced_head) {
+        uv_timer_stop(timer);
+    }
+}
+
+// schedule a peer's next deadline on the wheel
+static void
+peer_schedule(meshchat_t *mc, peer_t *peer) {
+    struct peerstore *ps = &mc->store;
+    peer_id_t id = peer->id;
+    uint64_t at = ps->next_greet[id];
+    if ((ps->status[id] == PEER_CONTACTED || ps->status[id] == PEER_ACTIVE) &&
+            at > ps->last_message[id] + 1000 * MESHCHAT_TIMEOUT) {
+        at = ps->last_message[id] + 1000 * MESHCHAT_TIMEOUT;
+    }
+    // round up, so they aren't early
+    timerwheel_add(&mc->wheel, &peer->timer,
+            (at + MESHCHAT_WHEEL_TICK) / MESHCHAT_WHEEL_TICK);
+}
+
+static uint32_t
+mc_random(meshchat_t *mc) {
+    // xorshift64*
+    mc->random ^= mc->random >> 12;
+    mc->random ^= mc->random << 25;
+    mc->random ^= mc->random >> 27;
+    return (mc->random * 2685821657736338717ULL) >> 32;
+}
+
+// an interval in ms, varied by up to MESHCHAT_GREET_JITTER percent
+static uint64_t
+jitter(meshchat_t *mc, uint64_t interval) {
+    uint64_t spread = interval * MESHCHAT_GREET_JITTER / 100;
+    if (!spread) {
+        return interval;
+    }
+    return interval - spread + mc_random(mc) % (2 * spread + 1);
+}
+
+// greetings sent so far in the current tick
+static unsigned long
+greet_tick_count(meshchat_t *mc) {
+    uint64_t tick = uv_now(uv_default_loop()) / MESHCHAT_WHEEL_TICK;
+    if (tick != mc->greet_tick) {
+        unsigned long n = mc->greet_tick_n;
+        mc->stats.greet_sum += n;
+        mc->stats.greet_sum_sq += (uint64_t)n * n;
+        if (n > mc->stats.greet_tick_max) {
+            mc->stats.greet_tick_max = n;
+        }
+        mc->greet_tick = tick;
+        mc->greet_tick_n = 0;
+    }
+    return mc->greet_tick_n;
+}
+
+// whether a peer has been gone long enough to forget. they must not have
+// sent to us in a long time, and cjdns must have dropped them
+static int
+peer_stale(meshchat_t *mc, peer_t *peer, uint64_t now) {
+    uint64_t heard = mc->store.last_message[peer->id];
+    return !peer->listed && mc->store.status[peer->id] != PEER_ACTIVE &&
+        now - heard > 1000ULL * MESHCHAT_EVICT_AGE;
+}
+
+// take a peer out of the lists of peers with work waiting
+static void
+peer_unlink(meshchat_t *mc, peer_t *peer) {
+    peer_t **pp, *prev = NULL;
+    size_t i;
+    if (peer->paced) {
+        for (pp = &mc->paced_head; *pp; prev = *pp, pp = &(*pp)->paced_next) {
+            if (*pp == peer) {
+                *pp = peer->paced_next;
+                if (mc->paced_tail == peer) {
+                    mc->paced_tail = prev;
+                }
+                mc->paced_len--;
+                break;
+            }
+        }
+        peer->paced = 0;
+    }
+    if (peer->coalescing) {
+        for (pp = &mc->coalescing; *pp; pp = &(*pp)->coalesce_next) {
+            if (*pp == peer) {
+                *pp = peer->coalesce_next;
+                break;
+            }
+        }
+        peer->coalescing = 0;
+    }
+    for (i = 0; i < mc->acks_n; ) {
+        if (mc->acks[i] == peer) {
+            mc->acks[i] = mc->acks[--mc->acks_n];
+        } else {
+            i++;
+        }
+    }
+}
+
+// forget a peer and free everything of theirs
+static void
+peer_evict(meshchat_t *mc, peer_t *peer) {
+    khiter_t k;
+    // datagrams for them may be waiting to go out
+    batch_flush(mc);
+    timerwheel_del(&mc->wheel, &peer->timer);
+    rel_reset(mc, peer);
+    pace_reset(mc, peer);
+    coalesce_reset(mc, peer);
+    frag_reset(mc, peer);
+    channel_part_all(mc, peer);
+    peer_unlink(mc, peer);
+    peer_clear_nick(mc, peer);
+    if (peer->listed) {
+        // cjdns still knows them. have the next dump tell us again
+        cjdnsadmin_forget(mc->cjdnsadmin, &peer->addr.sin6_addr);
+    }
+    free(peer->chans);
+    k = kh_get(peer, mc->peers, peer->addr.sin6_addr);
+    if (k != kh_end(mc->peers)) {
+        kh_del(peer, mc->peers, k);
+    }
+    peerstore_remove(&mc->store, peer->id);
+    free(peer);
+}
+
+// evict a peer to make room for a new one: of a few picked at random,
+// one cjdns has dropped if there is one, else the one heard from least
+// recently. returns -1 if none of them can go
+static int
+peers_make_room(meshchat_t *mc) {
+    struct peerstore *ps = &mc->store;
+    peer_t *victim = NULL;
+    int i;
+    for (i = 0; i < MESHCHAT_EVICT_SAMPLE; i++) {
+        peer_id_t id = mc_random(mc) % ps->size;
+        peer_t *peer = peerstore_get(ps, id);
+        if (!peer || peer == mc->me || ps->status[id] == PEER_ACTIVE) {
+            continue;
+        }
+        if (!victim || (victim->listed && !peer->listed) ||
+                (victim->listed == peer->listed && ps->last_message[id] <
+                 ps->last_message[victim->id])) {
+            victim = peer;
+        }
+    }
+    if (!victim) {
+        return -1;
+    }
+    peer_evict(mc, victim);
+    mc->stats.evicted_full++;
+    return 0;
+}
+
+// a peer's deadline came due. deadlines only move later in between, as
+// they send to us and we greet them, so check which ones really passed
+static void
+service_peer(struct timerwheel_timer *timer, void *arg) {
+    meshchat_t *mc = arg;
+    peer_t *peer = timer->data;
+    struct peerstore *ps = &mc->store;
+    peer_id_t id = peer->id;
+    uint64_t now = uv_now(uv_default_loop());
+    if (peer == mc->me) {
+        return;
+    }
+    int defer = 0;
+    if (now >= ps->next_greet[id] &&
+            greet_tick_count(mc) >= MESHCHAT_GREET_BURST) {
+        // this tick has had its greetings. try again on the next
+        mc->stats.greet_deferred++;
+        defer = 1;
+    }
+    switch ((enum peer_status)ps->status[id]) {
+        // greet new unknown peer
+        case PEER_UNKNOWN:
+            if (defer) {
+                break;
+            }
+            greet_peer(mc, peer);
+            ps->status[id] = PEER_CONTACTED;
+            ps->last_message[id] = now;
+            break;
+        case PEER_CONTACTED:
+        case PEER_ACTIVE:
+            if (!defer && now >= ps->next_greet[id]) {
+                // ping active peer
+                greet_peer(mc, peer);
+            }
+            if (now - ps->last_message[id] > 1000 * MESHCHAT_TIMEOUT) {
+                // mark unreponsive peer as timed out
+                if (ps->status[id] == PEER_ACTIVE) {
                     // tell irc that they are gone
                     struct irc_prefix prefix = {
                         .nick = peer->nick,
                         .user = NULL,
-                        .host = peer->ip
+                        .host = peer_ip(peer)
                     };
                     ircd_quit(mc->ircd, &prefix, "Timed out");
                 }
-                peer->status = PEER_INACTIVE;
+                ps->status[id] = PEER_INACTIVE;
+                peer_release_nick(mc, peer);
+                ps->next_greet[id] = peer->last_greeted +
+                    jitter(mc, 1000 * MESHCHAT_RETRY_INTERVAL);
+                rel_reset(mc, peer);
+                pace_reset(mc, peer);
+                // irc forgot their channels, and they may forget ours
+                peer->digest = 0;
+                peer->sent_digest = 0;
+                coalesce_reset(mc, peer);
+                frag_reset(mc, peer);
+                channel_part_all(mc, peer);
             }
             break;
         case PEER_INACTIVE:
+            if (now >= ps->next_greet[id] && peer_stale(mc, peer, now)) {
+                // long gone. stop retrying them
+                peer_evict(mc, peer);
+                mc->stats.evicted_aged++;
+                return;
+            }
             // greet inactive peer after a while
-            if (time_since(&peer->last_greeted) > MESHCHAT_RETRY_INTERVAL) {
+            if (!defer && now >= ps->next_greet[id]) {
                 greet_peer(mc, peer);
-                peer->status = PEER_CONTACTED;
+                ps->status[id] = PEER_CONTACTED;
             }
             break;
     }
+    if (defer) {
+        timerwheel_add(&mc->wheel, &peer->timer,
+                now / MESHCHAT_WHEEL_TICK + 1);
+    } else {
+        peer_schedule(mc, peer);
+    }
+}
+
+static void
+outgoing_build(meshchat_t *mc, struct outgoing *out) {
+    static char buf[MESHCHAT_EVENT_MAX];
+    const struct event *ev = out->ev;
+    size_t len = wire_size(ev, ev->n, out->legacy);
+
+    out->built = 1;
+    if (len <= MESHCHAT_PAYLOAD_LEN) {
+        out->pkt = packet_new(mc);
+        if (out->pkt) {
+            out->pkt->len = wire_encode(ev, ev->n, out->legacy,
+                    out->pkt->data);
+        }
+    } else if (len <= MESHCHAT_EVENT_MAX) {
+        wire_encode(ev, ev->n, out->legacy, buf);
+        out->n = frag_split(mc, buf, len, out->frags);
+    } else {
+        fprintf(stderr, "truncated message\n");
+    }
+}
+
+// send an event to a peer: whole, in fragments if they can reassemble
+// them, or else with only the fields that fit in one datagram
+static void
+outgoing_send(meshchat_t *mc, peer_t *peer, struct outgoing *out,
+        void (*send)(meshchat_t *, peer_t *, struct packet *)) {
+    size_t i;
+    if (!out->built) {
+        outgoing_build(mc, out);
+    }
+    if (out->pkt) {
+        send(mc, peer, out->pkt);
+        return;
+    }
+    if (out->n && (peer->caps & PEER_CAP_FRAG)) {
+        for (i = 0; i < out->n; i++) {
+            send(mc, peer, out->frags[i]);
+        }
+        return;
+    }
+    if (!out->trunc) {
+        unsigned int n = out->ev->n;
+        while (n && wire_size(out->ev, n, out->legacy) > MESHCHAT_PAYLOAD_LEN) {
+            n--;
+        }
+        out->trunc = packet_new(mc);
+        if (!out->trunc) {
+            return;
+        }
+        out->trunc->len = wire_encode(out->ev, n, out->legacy,
+                out->trunc->data);
+    }
+    send(mc, peer, out->trunc);
+    mc->stats.frag_truncated++;
+}
+
+static void
+outgoing_free(meshchat_t *mc, struct outgoing *out) {
+    size_t i;
+    if (out->pkt) {
+        packet_unref(mc, out->pkt);
+    }
+    for (i = 0; i < out->n; i++) {
+        packet_unref(mc, out->frags[i]);
+    }
+    if (out->trunc) {
+        packet_unref(mc, out->trunc);
+    }
+}
+
+// whether a peer gets events in the old format
+static inline int
+peer_legacy(const peer_t *peer) {
+    return MESHCHAT_WIRE_LEGACY && !(peer->caps & PEER_CAP_WIRE);
+}
+
+static struct channel *
+channel_get(meshchat_t *mc, const char *name) {
+    return hash_get(mc->channel_index, (char *)name);
+}
+
+// note that a peer is in a channel
+static struct channel *
+channel_join(meshchat_t *mc, peer_t *peer, const char *name) {
+    struct channel *chan = channel_get(mc, name);
+    size_t i;
+    if (!chan) {
+        chan = calloc(1, sizeof(struct channel));
+        if (!chan || !(chan->name = strdup(name))) {
+            perror("channel_join");
+            free(chan);
+            return NULL;
+        }
+        hash_set(mc->channel_index, chan->name, chan);
+    } else {
+        for (i = 0; i < peer->chans_n; i++) {
+            if (peer->chans[i] == chan) {
+                return chan;
+            }
+        }
+    }
+
+    if (chan->n == chan->capacity) {
+        size_t capacity = chan->capacity ? 2 * chan->capacity : 4;
+        peer_t **members = realloc(chan->members,
+                capacity * sizeof(peer_t *));
+        if (!members) {
+            perror("realloc");
+            return NULL;
+        }
+        chan->members = members;
+        chan->capacity = capacity;
+    }
+    if (peer->chans_n == peer->chans_capacity) {
+        size_t capacity = peer->chans_capacity ? 2 * peer->chans_capacity : 4;
+        struct channel **chans = realloc(peer->chans,
+                capacity * sizeof(struct channel *));
+        if (!chans) {
+            perror("realloc");
+            return NULL;
+        }
+        peer->chans = chans;
+        peer->chans_capacity = capacity;
+    }
+    chan->members[chan->n++] = peer;
+    peer->chans[peer->chans_n++] = chan;
+    mc->memberships++;
+    return chan;
+}
+
+// take a peer out of a channel's members, freeing the channel when empty
+static void
+channel_remove(meshchat_t *mc, struct channel *chan, peer_t *peer) {
+    size_t i;
+    for (i = 0; i < chan->n; i++) {
+        if (chan->members[i] == peer) {
+            chan->members[i] = chan->members[--chan->n];
+            mc->memberships--;
+            break;
+        }
+    }
+    if (!chan->n) {
+        hash_del(mc->channel_index, chan->name);
+        free(chan->members);
+        free(chan->name);
+        free(chan);
+    }
+}
+
+static void
+channel_part(meshchat_t *mc, peer_t *peer, const char *name) {
+    struct channel *chan = channel_get(mc, name);
+    size_t i;
+    if (!chan) {
+        return;
+    }
+    for (i = 0; i < peer->chans_n; i++) {
+        if (peer->chans[i] == chan) {
+            peer->chans[i] = peer->chans[--peer->chans_n];
+            channel_remove(mc, chan, peer);
+            return;
+        }
+    }
+}
+
+// forget all of a peer's channels, e.g. when they time out
+static void
+channel_part_all(meshchat_t *mc, peer_t *peer) {
+    while (peer->chans_n) {
+        channel_remove(mc, peer->chans[--peer->chans_n], peer);
+    }
 }
 
 static inline void
-broadcast_all_peer(meshchat_t *mc, peer_t *peer, char *msg, size_t len) {
+broadcast_peer(meshchat_t *mc, peer_t *peer, struct outgoing *out) {
     // send only to active peer
-    if (peer->status == PEER_ACTIVE) {
-        peer_send(mc, peer, msg, len);
-        printf("sending (%s) %s to %s\n", event_names[(int)msg[0]], msg+1, peer->ip);
+    if (mc->store.status[peer->id] == PEER_ACTIVE) {
+        outgoing_send(mc, peer, &out[peer_legacy(peer)], peer_transmit);
+    }
+}
+
+// send an event to the active peers in a channel, or to all of them
+static void
+broadcast(meshchat_t *mc, const struct event *ev, struct channel *chan) {
+    // encoded for each wire format, as peers need them
+    struct outgoing out[2] = {{ev, 0}, {ev, 1}};
+    unsigned long batches = mc->stats.batches;
+    unsigned long sent = mc->stats.batch_sent;
+    unsigned long queued = mc->stats.send_queued;
+    unsigned long paced = mc->stats.pace_queued;
+    unsigned long held = mc->stats.coalesce_events;
+    size_t i;
+    if (chan) {
+        for (i = 0; i < chan->n; i++) {
+            broadcast_peer(mc, chan->members[i], out);
+        }
+    } else {
+        // check status in the store before touching the rest of a peer
+        struct peerstore *ps = &mc->store;
+        peerstore_each(ps, {
+            if (ps->status[id] == PEER_ACTIVE) {
+                broadcast_peer(mc, peerstore_get(ps, id), out);
+            }
+        });
     }
+    batch_flush(mc);
+    printf("sending (%s) %s: %lu datagrams in %lu batches, %lu queued, "
+            "%lu paced, %lu coalesced\n",
+            event_names[ev->type], wire_field(ev, 0),
+            mc->stats.batch_sent - sent, mc->stats.batches - batches,
+            mc->stats.send_queued - queued, mc->stats.pace_queued - paced,
+            mc->stats.coalesce_events - held);
+    outgoing_free(mc, &out[0]);
+    outgoing_free(mc, &out[1]);
 }
 
-// send a message to all active peers
+// send an event to all active peers
 void
-broadcast_all(meshchat_t *mc, char *msg, size_t len) {
-    hash_each_val(mc->peers, broadcast_all_peer(mc, val, msg, len));
+broadcast_all(meshchat_t *mc, const struct event *ev) {
+    broadcast(mc, ev, NULL);
 }
 
 // send a message to all active peers in a channel
 void
-broadcast_channel(meshchat_t *mc, char *channel, void *msg, size_t len) {
-    // todo: broadcast only to channel
-    broadcast_all(mc, msg, len);
-    //hash_each_val(mc->peers, broadcast_active_peer(mc, val, msg, len));
+broadcast_channel(meshchat_t *mc, char *channel, const struct event *ev) {
+    struct channel *chan = channel_get(mc, channel);
+    mc->stats.chan_events++;
+    if (!chan) {
+        // nobody else is in it
+        return;
+    }
+    mc->stats.chan_sent += chan->n;
+    broadcast(mc, ev, chan);
 }
 
 void
 service_peers(uv_timer_t* handle) {
     meshchat_t *mc = handle->data;
-    //printf("servicing peers (%u)\n", hash_size(mc->peers));
-    hash_each_val(mc->peers, service_peer(mc, val));
+    uint64_t now = uv_now(uv_default_loop());
+    uint64_t ticks = mc->wheel.now;
+    size_t fired;
+    // only peers with a deadline due are touched
+    fired = timerwheel_advance(&mc->wheel, now / MESHCHAT_WHEEL_TICK,
+            service_peer, mc);
+    mc->stats.wheel_ticks += mc->wheel.now - ticks;
+    mc->stats.wheel_fired += fired;
+    if (fired > mc->stats.wheel_fired_max) {
+        mc->stats.wheel_fired_max = fired;
+    }
+    batch_flush(mc);
+    frag_expire(mc, now);
+}
+
+// greetings are sent again periodically, so they skip the reliability layer
+static void
+greeting_send(meshchat_t *mc, peer_t *peer, struct packet *pkt) {
+    pace_send(mc, peer, NULL, 0, pkt);
+}
+
+// digest of a channel list, not depending on its order. never 0
+static uint64_t
+channels_digest(const char *p, const char *end) {
+    uint64_t digest = 0;
+    const char *item;
+    while ((item = wire_list_next(&p, end))) {
+        // fnv-1a
+        uint64_t hash = 14695981039346656037ULL;
+        for (; *item; item++) {
+            hash = (hash ^ (unsigned char)*item) * 1099511628211ULL;
+        }
+        digest += hash;
+    }
+    return digest ? digest : 1;
+}
+
+// bytes of whole channels from the start of a list that fit in max
+static size_t
+channels_fit(const char *list, size_t len, size_t max) {
+    const char *p = list;
+    size_t fit = 0;
+    while (wire_list_next(&p, list + len) && (size_t)(p - list) <= max) {
+        fit = p - list;
+    }
+    return fit;
 }
 
 void
 greet_peer(meshchat_t *mc, peer_t *peer) {
-    static char msg[MESHCHAT_PACKETLEN];
-    size_t len = 1;
-    //printf("greeting peer %s\n", peer->ip);
-    msg[0] = EVENT_GREETING;
-    // format: nick,channels...
-    size_t nick_len = strlen(mc->nick) + 1;
-    strncpy(msg + 1, mc->nick, nick_len);
-    len += nick_len;
-    len += ircd_get_channels(mc->ircd, msg + len, sizeof(msg) - len);
-    peer_send(mc, peer, msg, len);
-    current_clock(&peer->last_greeted);
+    char caps[64];
+    char digest[8];
+    size_t i, caps_len = 0, max;
+    struct event ev = {.type = EVENT_GREETING, .n = 3};
+    struct outgoing out = {&ev, peer_legacy(peer)};
+    //printf("greeting peer %s\n", peer_ip(peer));
+
+    if (mc->channels_dirty) {
+        mc->channels_len = ircd_get_channels(mc->ircd, mc->channels,
+                sizeof(mc->channels));
+        mc->digest = channels_digest(mc->channels,
+                mc->channels + mc->channels_len);
+        mc->channels_dirty = 0;
+    }
+
+    // format: nick, channels, capabilities, digest of the channels
+    ev.field[0] = mc->nick;
+    ev.len[0] = strlen(mc->nick);
+    ev.field[1] = mc->channels;
+    ev.len[1] = 0;
+    for (i = 0; i < sizeof(capabilities) / sizeof(*capabilities); i++) {
+        if (mc->caps & capabilities[i].cap) {
+            size_t cap_len = strlen(capabilities[i].name) + 1;
+            memcpy(caps + caps_len, capabilities[i].name, cap_len);
+            caps_len += cap_len;
+        }
+    }
+    ev.field[2] = caps;
+    ev.len[2] = caps_len;
+    if (!out.legacy) {
+        put_u64(digest, mc->digest);
+        ev.field[3] = digest;
+        ev.len[3] = sizeof(digest);
+        ev.n = 4;
+    }
+
+    if (!out.legacy && peer->sent_digest == mc->digest) {
+        // they have our channels
+        ev.flags |= GREETING_NO_CHANNELS;
+        mc->stats.greet_delta++;
+    } else {
+        // peers that reassemble fragments get all of our channels
+        max = peer->caps & PEER_CAP_FRAG ?
+            MESHCHAT_EVENT_MAX : MESHCHAT_PAYLOAD_LEN;
+        ev.len[1] = channels_fit(mc->channels, mc->channels_len,
+                max - wire_size(&ev, ev.n, out.legacy));
+        // a list cut short must be sent again, or they never get the rest
+        if (!out.legacy && ev.len[1] == mc->channels_len) {
+            peer->sent_digest = mc->digest;
+        }
+        mc->stats.greet_full++;
+    }
+
+    outgoing_send(mc, peer, &out, greeting_send);
+    outgoing_free(mc, &out);
+    peer->last_greeted = uv_now(uv_default_loop());
+    mc->store.next_greet[peer->id] = peer->last_greeted +
+        jitter(mc, 1000 * MESHCHAT_PING_INTERVAL);
+    greet_tick_count(mc);
+    mc->greet_tick_n++;
+}
+
+// ask a peer for a greeting with their channels
+static void
+greet_request(meshchat_t *mc, peer_t *peer) {
+    struct event ev = {.type = EVENT_GREETING_REQ};
+    struct outgoing out = {&ev, 0};
+    outgoing_send(mc, peer, &out, greeting_send);
+    outgoing_free(mc, &out);
 }
 
 void
-broadcast_event(meshchat_t *mc, enum event_type ev, int argv, ...) {
-    static char msg[MESHCHAT_PACKETLEN];
-    int i, offset = 1;
-    msg[0] = ev;
+broadcast_event(meshchat_t *mc, enum event_type type, int argv, ...) {
+    struct event ev = {.type = type};
     va_list ap;
-    char *arg;
 
     va_start(ap, argv);
-    for (i = 0; i < argv; i++) {
-        arg = va_arg(ap, char *);
-        size_t len = strlen(arg)+1;
-        if (len + offset > MESHCHAT_PACKETLEN) {
-            fprintf(stderr, "truncated message\n");
-            break;
-        }
-        strncpy(msg + offset, arg, len);
-        offset += len;
+    for (ev.n = 0; ev.n < (unsigned int)argv && ev.n < WIRE_FIELDS; ev.n++) {
+        ev.field[ev.n] = va_arg(ap, char *);
+        ev.len[ev.n] = strlen(ev.field[ev.n]);
     }
     va_end(ap);
-    broadcast_all(mc, msg, offset);
+    broadcast_all(mc, &ev);
+}
+
+// send a message or notice to the peers in its channel
+static void
+channel_event(meshchat_t *mc, enum event_type type, char *channel,
+        char *data) {
+    struct event ev = {.type = type, .n = 2};
+    ev.field[0] = channel;
+    ev.len[0] = strlen(channel);
+    ev.field[1] = data;
+    ev.len[1] = strlen(data);
+    broadcast_channel(mc, channel, &ev);
+}
+
+// send a private message or notice to the one peer with the nick
+static void
+direct_event(meshchat_t *mc, enum event_type type, char *nick, char *data) {
+    peer_t *peer = hash_get(mc->nick_index, nick);
+    struct event ev = {.type = type, .n = 2};
+    struct outgoing out;
+
+    if (!peer || mc->store.status[peer->id] != PEER_ACTIVE) {
+        mc->stats.direct_unknown++;
+        ircd_no_such_nick(mc->ircd, nick);
+        return;
+    }
+    ev.field[0] = nick;
+    ev.len[0] = strlen(nick);
+    ev.field[1] = data;
+    ev.len[1] = strlen(data);
+    out = (struct outgoing){&ev, peer_legacy(peer)};
+    outgoing_send(mc, peer, &out, peer_transmit);
+    batch_flush(mc);
+    outgoing_free(mc, &out);
+    mc->stats.direct_sent++;
+    printf("sending (%s) %s to %s\n", event_names[type], nick, peer_ip(peer));
+}
+
+static inline int
+is_channel(const char *target) {
+    return strchr("#+&!", target[0]) != NULL;
 }
 
 void
 on_irc_msg(void *obj, char *channel, char *data) {
     meshchat_t *mc = (meshchat_t *)obj;
-    broadcast_event(mc, EVENT_MSG, 2, channel, data);
-    // TODO: only send the event to peers whom we think are in the channel
+    if (is_channel(channel)) {
+        channel_event(mc, EVENT_MSG, channel, data);
+    } else {
+        direct_event(mc, EVENT_MSG, channel, data);
+    }
 }
 
 void
 on_irc_notice(void *obj, char *channel, char *data) {
     meshchat_t *mc = (meshchat_t *)obj;
-    broadcast_event(mc, EVENT_NOTICE, 2, channel, data);
+    if (is_channel(channel)) {
+        channel_event(mc, EVENT_NOTICE, channel, data);
+    } else {
+        direct_event(mc, EVENT_NOTICE, channel, data);
+    }
 }
 
 // client joined a channel
@@ -551,12 +3235,14 @@ void
 on_irc_join(void *obj, char *channel, char *nick) {
     meshchat_t *mc = (meshchat_t *)obj;
     broadcast_event(mc, EVENT_JOIN, 2, channel, nick);
+    mc->channels_dirty = 1;
 }
 
 void
 on_irc_part(void *obj, char *channel, char *data) {
     meshchat_t *mc = (meshchat_t *)obj;
     broadcast_event(mc, EVENT_PART, 2, channel, data);
+    mc->channels_dirty = 1;
 }
 
 void
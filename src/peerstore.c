@@ -0,0 +1,77 @@
+/* vim: set expandtab ts=4 sw=4: */
+
+#include "peerstore.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void
+peerstore_init(struct peerstore *ps) {
+    memset(ps, 0, sizeof(*ps));
+}
+
+void
+peerstore_free(struct peerstore *ps) {
+    free(ps->status);
+    free(ps->last_message);
+    free(ps->next_greet);
+    free(ps->cold);
+    free(ps->free_ids);
+    memset(ps, 0, sizeof(*ps));
+}
+
+// grow one of the arrays to capacity, keeping it if that fails
+#define PEERSTORE_GROW(ps, array, capacity) do { \
+    void *p = realloc((ps)->array, (capacity) * sizeof(*(ps)->array)); \
+    if (!p) { \
+        return -1; \
+    } \
+    (ps)->array = p; \
+} while (0)
+
+static int
+peerstore_grow(struct peerstore *ps) {
+    size_t capacity = ps->capacity ? 2 * (size_t)ps->capacity : 64;
+    if (capacity >= PEER_ID_NONE) {
+        return -1;
+    }
+    // arrays that grew before a failure just keep the room
+    PEERSTORE_GROW(ps, status, capacity);
+    PEERSTORE_GROW(ps, last_message, capacity);
+    PEERSTORE_GROW(ps, next_greet, capacity);
+    PEERSTORE_GROW(ps, cold, capacity);
+    PEERSTORE_GROW(ps, free_ids, capacity);
+    ps->capacity = capacity;
+    return 0;
+}
+
+peer_id_t
+peerstore_add(struct peerstore *ps, void *cold) {
+    peer_id_t id;
+    if (ps->free_n) {
+        id = ps->free_ids[--ps->free_n];
+    } else {
+        if (ps->size == ps->capacity && peerstore_grow(ps) < 0) {
+            return PEER_ID_NONE;
+        }
+        id = ps->size++;
+    }
+    ps->status[id] = 0;
+    ps->last_message[id] = 0;
+    ps->next_greet[id] = 0;
+    ps->cold[id] = cold;
+    ps->count++;
+    return id;
+}
+
+void
+peerstore_remove(struct peerstore *ps, peer_id_t id) {
+    if (id >= ps->size || !ps->cold[id]) {
+        return;
+    }
+    ps->cold[id] = NULL;
+    ps->status[id] = 0;
+    // free_ids has room for every id
+    ps->free_ids[ps->free_n++] = id;
+    ps->count--;
+}
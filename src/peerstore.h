@@ -0,0 +1,57 @@
+/* vim: set expandtab ts=4 sw=4: */
+/*
+ * peerstore.h
+ */
+
+#ifndef PEERSTORE_H
+#define PEERSTORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// the state of every peer that passes over all of them need, kept in one
+// array per field and indexed by a small peer id. that is about 25 bytes a
+// peer, so the hot loops stay in cache with many thousands of peers. the
+// rest of a peer lives out of line, behind the cold pointer. ids of removed
+// peers are handed out again, so they stay as small as the number of peers
+typedef uint32_t peer_id_t;
+
+#define PEER_ID_NONE UINT32_MAX
+
+struct peerstore {
+    uint8_t *status;            // enum peer_status
+    uint64_t *last_message;     // they sent to us, loop time in ms
+    uint64_t *next_greet;       // when to greet them again
+    void **cold;                // NULL for unused ids
+    peer_id_t *free_ids;        // removed ids, to reuse
+    size_t free_n;
+    peer_id_t size;             // ids handed out
+    peer_id_t capacity;
+    size_t count;               // peers in the store
+};
+
+void peerstore_init(struct peerstore *ps);
+
+void peerstore_free(struct peerstore *ps);
+
+// add a peer, with its hot fields zeroed. returns its id, or PEER_ID_NONE
+// if there is no memory for it
+peer_id_t peerstore_add(struct peerstore *ps, void *cold);
+
+void peerstore_remove(struct peerstore *ps, peer_id_t id);
+
+static inline void *
+peerstore_get(const struct peerstore *ps, peer_id_t id) {
+    return ps->cold[id];
+}
+
+// iterate the ids in use, populating `id`
+#define peerstore_each(ps, block) { \
+    peer_id_t id; \
+    for (id = 0; id < (ps)->size; id++) { \
+        if (!(ps)->cold[id]) continue; \
+        block; \
+    } \
+}
+
+#endif /* PEERSTORE_H */
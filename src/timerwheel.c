@@ -0,0 +1,121 @@
+/* vim: set expandtab ts=4 sw=4: */
+
+#include "timerwheel.h"
+
+#include <string.h>
+
+#define TIMERWHEEL_MASK (TIMERWHEEL_SLOTS - 1)
+// furthest a timer can be from now
+#define TIMERWHEEL_RANGE \
+    (((uint64_t)1 << (TIMERWHEEL_BITS * TIMERWHEEL_LEVELS)) - 1)
+
+void
+timerwheel_init(struct timerwheel *wheel, uint64_t now) {
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->now = now;
+}
+
+void
+timerwheel_timer_init(struct timerwheel_timer *timer, void *data) {
+    timer->expires = 0;
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->data = data;
+}
+
+static void
+link_timer(struct timerwheel *wheel, struct timerwheel_timer *timer) {
+    uint64_t delta = timer->expires - wheel->now;
+    struct timerwheel_timer **slot;
+    int level = 0;
+
+    while (level < TIMERWHEEL_LEVELS - 1 &&
+            delta >= (uint64_t)1 << (TIMERWHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    slot = &wheel->slots[level][(timer->expires >>
+            (TIMERWHEEL_BITS * level)) & TIMERWHEEL_MASK];
+    timer->next = *slot;
+    if (*slot) {
+        (*slot)->pprev = &timer->next;
+    }
+    *slot = timer;
+    timer->pprev = slot;
+}
+
+static void
+unlink_timer(struct timerwheel_timer *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+void
+timerwheel_add(struct timerwheel *wheel, struct timerwheel_timer *timer,
+        uint64_t expires) {
+    if (timer->pprev) {
+        unlink_timer(timer);
+    } else {
+        wheel->count++;
+    }
+    if (expires <= wheel->now) {
+        expires = wheel->now + 1;
+    } else if (expires - wheel->now > TIMERWHEEL_RANGE) {
+        expires = wheel->now + TIMERWHEEL_RANGE;
+    }
+    timer->expires = expires;
+    link_timer(wheel, timer);
+}
+
+void
+timerwheel_del(struct timerwheel *wheel, struct timerwheel_timer *timer) {
+    if (timer->pprev) {
+        unlink_timer(timer);
+        wheel->count--;
+    }
+}
+
+// move the timers of a slot down to the levels below
+static void
+cascade(struct timerwheel *wheel, int level) {
+    int index = (wheel->now >> (TIMERWHEEL_BITS * level)) & TIMERWHEEL_MASK;
+    struct timerwheel_timer *timer = wheel->slots[level][index];
+    wheel->slots[level][index] = NULL;
+    while (timer) {
+        struct timerwheel_timer *next = timer->next;
+        link_timer(wheel, timer);
+        timer = next;
+    }
+}
+
+size_t
+timerwheel_advance(struct timerwheel *wheel, uint64_t now,
+        timerwheel_cb cb, void *arg) {
+    size_t ran = 0;
+    while (wheel->now < now) {
+        struct timerwheel_timer **slot;
+        int level;
+
+        wheel->now++;
+        for (level = 1; level < TIMERWHEEL_LEVELS; level++) {
+            if (wheel->now & (((uint64_t)1 <<
+                            (TIMERWHEEL_BITS * level)) - 1)) {
+                break;
+            }
+            cascade(wheel, level);
+        }
+
+        slot = &wheel->slots[0][wheel->now & TIMERWHEEL_MASK];
+        while (*slot) {
+            struct timerwheel_timer *timer = *slot;
+            unlink_timer(timer);
+            wheel->count--;
+            ran++;
+            cb(timer, arg);
+        }
+    }
+    return ran;
+}
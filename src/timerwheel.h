@@ -0,0 +1,57 @@
+/* vim: set expandtab ts=4 sw=4: */
+/*
+ * timerwheel.h
+ */
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// hierarchical timing wheel. each level has 64 slots, each slot covering
+// 64 times the ticks of a slot in the level below, so adding, removing
+// and expiring a timer are O(1). timers further out than the top level
+// reaches are put in its last slot, and find out they are early when
+// they fire.
+#define TIMERWHEEL_BITS 6
+#define TIMERWHEEL_SLOTS (1 << TIMERWHEEL_BITS)
+#define TIMERWHEEL_LEVELS 4
+
+struct timerwheel_timer {
+    uint64_t expires;   // tick
+    struct timerwheel_timer *next;
+    struct timerwheel_timer **pprev; // NULL while not scheduled
+    void *data;
+};
+
+struct timerwheel {
+    uint64_t now;       // the last tick that was run
+    size_t count;
+    struct timerwheel_timer *slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];
+};
+
+typedef void (*timerwheel_cb)(struct timerwheel_timer *timer, void *arg);
+
+void timerwheel_init(struct timerwheel *wheel, uint64_t now);
+
+void timerwheel_timer_init(struct timerwheel_timer *timer, void *data);
+
+// schedule a timer for a tick, rescheduling it if it is already. ticks
+// that are already past run on the next one
+void timerwheel_add(struct timerwheel *wheel, struct timerwheel_timer *timer,
+        uint64_t expires);
+
+void timerwheel_del(struct timerwheel *wheel, struct timerwheel_timer *timer);
+
+// run the ticks up to now, calling cb for each timer that expires. the
+// callback may add or remove timers. returns the number of timers run
+size_t timerwheel_advance(struct timerwheel *wheel, uint64_t now,
+        timerwheel_cb cb, void *arg);
+
+static inline int
+timerwheel_pending(const struct timerwheel_timer *timer) {
+    return timer->pprev != NULL;
+}
+
+#endif /* TIMERWHEEL_H */
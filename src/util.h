@@ -7,6 +7,8 @@
 #define UTIL_H
 
 #include <arpa/inet.h>
+#include <stdint.h>
+#include <string.h>
 
 const char *sprint_addrport(const struct sockaddr *addr);
 int strwncpy(char *dst, const char *src, size_t max);
@@ -16,6 +18,19 @@ double time_since(struct timespec* event);
 
 int canonicalize_ipv6(char *dest, const char *src);
 
+// hash of an ipv6 address, for tables keyed on the binary form
+static inline unsigned int
+in6_hash(struct in6_addr addr) {
+    uint64_t hi, lo;
+    memcpy(&hi, addr.s6_addr, 8);
+    memcpy(&lo, addr.s6_addr + 8, 8);
+    // cjdns addresses are mostly well mixed already, but ours needn't be
+    hi ^= lo * 0x9e3779b97f4a7c15ULL;
+    return (unsigned int)(hi ^ hi >> 32);
+}
+
+#define in6_equal(a, b) (memcmp((a).s6_addr, (b).s6_addr, 16) == 0)
+
 #define NEW(type) ((type*)malloc(sizeof(type)))
 #define AMNEW(type,name) type* name = NEW(type)
 
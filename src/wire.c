@@ -0,0 +1,127 @@
+/* vim: set expandtab ts=4 sw=4: */
+
+#include "wire.h"
+
+#include <string.h>
+
+int
+wire_decode(struct event *ev, const char *msg, size_t len) {
+    const unsigned char *u = (const unsigned char *)msg;
+    const char *p = msg + WIRE_HDR_LEN;
+    const char *end = msg + len;
+    unsigned int i;
+
+    if (len < WIRE_HDR_LEN || u[0] != WIRE_MARK || u[3] > WIRE_FIELDS) {
+        return -1;
+    }
+    // flags are for extensions. ones we don't know about are ignored
+    ev->flags = u[1];
+    ev->type = u[2];
+    ev->n = u[3];
+    for (i = 0; i < ev->n; i++) {
+        size_t field_len;
+        if (end - p < 3) {
+            return -1;
+        }
+        field_len = (size_t)(unsigned char)p[0] << 8 | (unsigned char)p[1];
+        p += 2;
+        if (field_len >= (size_t)(end - p) || p[field_len] != '\0') {
+            return -1;
+        }
+        ev->field[i] = p;
+        ev->len[i] = field_len;
+        p += field_len + 1;
+    }
+    // anything after the fields is left for later versions
+    return 0;
+}
+
+// the string at p, up to the next NUL or the end
+static const char *
+legacy_field(struct event *ev, const char *p, const char *end) {
+    const char *nul = memchr(p, '\0', end - p);
+    ev->field[ev->n] = p;
+    ev->len[ev->n] = (nul ? nul : end) - p;
+    ev->n++;
+    return nul ? nul + 1 : end;
+}
+
+int
+wire_decode_legacy(struct event *ev, const char *msg, size_t len) {
+    const char *p = msg + 1;
+    const char *end = msg + len;
+
+    if (!len) {
+        return -1;
+    }
+    ev->type = (unsigned char)msg[0];
+    ev->flags = 0;
+    ev->n = 0;
+    if (ev->type != EVENT_GREETING) {
+        while (p < end && ev->n < WIRE_FIELDS) {
+            p = legacy_field(ev, p, end);
+        }
+        return 0;
+    }
+
+    // greeting: nick, channels ended by an empty one, capabilities
+    p = legacy_field(ev, p, end);
+    ev->field[1] = p;
+    while (p < end && *p) {
+        wire_list_next(&p, end);
+    }
+    ev->len[1] = p - ev->field[1];
+    if (p < end) {
+        p++;
+    }
+    ev->field[2] = p;
+    ev->len[2] = end - p;
+    ev->n = 3;
+    return 0;
+}
+
+size_t
+wire_size(const struct event *ev, unsigned int n, int legacy) {
+    size_t len = legacy ? 1 : WIRE_HDR_LEN;
+    unsigned int i;
+    for (i = 0; i < n; i++) {
+        len += ev->len[i] + (legacy ? 1 : 3);
+    }
+    return len;
+}
+
+size_t
+wire_encode(const struct event *ev, unsigned int n, int legacy, char *buf) {
+    char *p = buf;
+    unsigned int i;
+    if (legacy) {
+        *p++ = ev->type;
+    } else {
+        *p++ = (char)WIRE_MARK;
+        *p++ = ev->flags;
+        *p++ = ev->type;
+        *p++ = n;
+    }
+    for (i = 0; i < n; i++) {
+        if (!legacy) {
+            *p++ = ev->len[i] >> 8;
+            *p++ = ev->len[i];
+        }
+        memcpy(p, ev->field[i], ev->len[i]);
+        p += ev->len[i];
+        *p++ = '\0';
+    }
+    return p - buf;
+}
+
+const char *
+wire_list_next(const char **p, const char *end) {
+    const char *item = *p;
+    const char *nul;
+    if (item >= end) {
+        return NULL;
+    }
+    nul = memchr(item, '\0', end - item);
+    *p = nul ? nul + 1 : end;
+    return item;
+}
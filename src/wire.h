@@ -0,0 +1,67 @@
+/* vim: set expandtab ts=4 sw=4: */
+/*
+ * wire.h
+ */
+
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stddef.h>
+
+// versioned events start with this byte, which no event type uses. then
+// come flags, the event type and the field count, then each field as a
+// 2-byte length, its bytes and a NUL
+#define WIRE_VERSION 2
+#define WIRE_MARK (0x80 | WIRE_VERSION)
+#define WIRE_HDR_LEN 4
+#define WIRE_FIELDS 4   // most fields an event carries
+
+enum event_type {
+    EVENT_GREETING = 1,
+    EVENT_MSG,
+    EVENT_NOTICE,
+    EVENT_JOIN,
+    EVENT_PART,
+    EVENT_NICK,
+    EVENT_DATA,     // epoch, seq, una, event
+    EVENT_ACK,      // epoch, cumulative ack, selective ack bits
+    EVENT_BUNDLE,   // (length, event, NUL)...
+    EVENT_FRAG,     // message id, index, count, data
+    EVENT_GREETING_REQ, // send me your full greeting
+};
+
+// a decoded event. fields point into the datagram, and each is followed
+// by a NUL so it can be used as a string. list fields, like the channels
+// in a greeting, hold NUL-terminated items
+struct event {
+    enum event_type type;
+    unsigned int flags;
+    unsigned int n;
+    const char *field[WIRE_FIELDS];
+    size_t len[WIRE_FIELDS];
+};
+
+// decode a versioned event. returns 0, or -1 if it is malformed
+int wire_decode(struct event *ev, const char *msg, size_t len);
+
+// decode an event in the old format: type then NUL-separated strings.
+// msg must be NUL-terminated after len bytes
+int wire_decode_legacy(struct event *ev, const char *msg, size_t len);
+
+// bytes needed to encode the first n fields of an event
+size_t wire_size(const struct event *ev, unsigned int n, int legacy);
+
+// encode the first n fields of an event, returning its length
+size_t wire_encode(const struct event *ev, unsigned int n, int legacy,
+        char *buf);
+
+// the next item of a list field, advancing p, or NULL at the end
+const char *wire_list_next(const char **p, const char *end);
+
+// a field, or an empty string if the event doesn't have it
+static inline const char *
+wire_field(const struct event *ev, unsigned int i) {
+    return i < ev->n ? ev->field[i] : "";
+}
+
+#endif /* WIRE_H */